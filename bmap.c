@@ -19,23 +19,339 @@
 #include <inttypes.h>
 #include <limits.h>
 #include <string.h>
+#include <stddef.h>
 #include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#if defined(__AVX2__) || defined(__BMI2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include "bmap.h"
 
+/*
+ * This file is compiled once per ISA level (see the Makefile) with
+ * -DBMAP_ISA=<level>. Every copy exports its interfaces with the
+ * level as a suffix and bmap_isa.c picks the right set at startup.
+ */
+#ifdef BMAP_ISA
+#define BMAP_IFACE(n) BMAP_IFACE_(n, BMAP_ISA)
+#define BMAP_IFACE_(n, isa) BMAP_IFACE__(n, isa)
+#define BMAP_IFACE__(n, isa) bmap_##n##_##isa
+#else
+#define BMAP_IFACE(n) bmap_##n
+#endif
+
+/*
+ * Instrumentation of first_set in the pyramids.
+ *
+ * Only compiled in with -DBMAP_INSTRUMENT. The searches count what
+ * they do in fs_call through the FS_ macros, which are empty in
+ * normal builds. FS_INSTRUMENT(fn) generates a wrapper around a
+ * first_set function that resets fs_call and adds it to the
+ * histograms in bmap_fs_stats after the call, FS(fn) is the name to
+ * put in the interface. bmap_fs_stats lives in bmap_isa.c since
+ * this file is compiled more than once.
+ */
+#ifdef BMAP_INSTRUMENT
+static struct {
+	unsigned int depth;	/* highest level touched + 1 */
+	unsigned int climbs;
+	unsigned int descents;
+	unsigned int words;
+} fs_call;
+
+static inline void
+fs_hist(unsigned long long *h, unsigned int n)
+{
+	h[n < BMAP_FS_HIST ? n : BMAP_FS_HIST - 1]++;
+}
+
+static unsigned int
+fs_end(unsigned int r)
+{
+	bmap_fs_stats.calls++;
+	if (fs_call.words == 1 && r != BMAP_INVALID_OFF)
+		bmap_fs_stats.peek_hits++;
+	fs_hist(bmap_fs_stats.depth, fs_call.depth);
+	fs_hist(bmap_fs_stats.climbs, fs_call.climbs);
+	fs_hist(bmap_fs_stats.descents, fs_call.descents);
+	fs_hist(bmap_fs_stats.words, fs_call.words);
+	return r;
+}
+
+#define FS_WORD(l) do { fs_call.words++; if ((l) + 1 > fs_call.depth) fs_call.depth = (l) + 1; } while (0)
+#define FS_CLIMB() fs_call.climbs++
+#define FS_DESCEND() fs_call.descents++
+#define FS_INSTRUMENT(fn) \
+static unsigned int \
+fn##_fs(void *v, unsigned int b) \
+{ \
+	memset(&fs_call, 0, sizeof(fs_call)); \
+	return fs_end(fn(v, b)); \
+}
+#define FS(fn) fn##_fs
+#else
+#define FS_WORD(l)
+#define FS_CLIMB()
+#define FS_DESCEND()
+#define FS_INSTRUMENT(fn)
+#define FS(fn) fn
+#endif
+
+/*
+ * The p64v3 layout and the recursive search are in bmap_inline.h so
+ * that they can be inlined by users, with the FS_ hooks compiled in
+ * and short names for use in here.
+ */
+#define BMAP_FS_WORD(l) FS_WORD(l)
+#define BMAP_FS_CLIMB() FS_CLIMB()
+#define BMAP_FS_DESCEND() FS_DESCEND()
+#include "bmap_inline.h"
+
+#define P64V3_MAXLEVELS BMAP_P64V3_MAXLEVELS
+#define p64v3_bmap bmap_p64v3_bmap
+#define p64v3_bpb bmap_p64v3_bpb
+#define p64v3_bps bmap_p64v3_bps
+#define p64v3_slot bmap_p64v3_slot
+#define p64v3_mask bmap_p64v3_mask
+#define p64v3_slots_per_level bmap_p64v3_slots_per_level
+#define p64v3_pbslot bmap_p64v3_pbslot
+#define p64v3_levels bmap_p64v3_levels
+#define p64v3_first_set_r bmap_p64v3r_first_set_r
+
+/*
+ * Population count of an array of words.
+ *
+ * With AVX2 we use the Harley-Seal carry-save adder tree over blocks
+ * of 16 vectors (64 words) with the vpshufb nibble lookup for the
+ * final counts (Muła, Kurz, Lemire, "Faster Population Counts Using
+ * AVX2 Instructions"). Short spans are faster with plain popcnt.
+ */
+#ifdef __AVX2__
+static inline __m256i
+popcount256(__m256i v)
+{
+	const __m256i lookup = _mm256_setr_epi8(
+	    0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+	    0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+	const __m256i nibble = _mm256_set1_epi8(0x0f);
+	__m256i lo = _mm256_shuffle_epi8(lookup, _mm256_and_si256(v, nibble));
+	__m256i hi = _mm256_shuffle_epi8(lookup, _mm256_and_si256(_mm256_srli_epi32(v, 4), nibble));
+
+	return _mm256_sad_epu8(_mm256_add_epi8(lo, hi), _mm256_setzero_si256());
+}
+
+static inline void
+csa256(__m256i *h, __m256i *l, __m256i a, __m256i b, __m256i c)
+{
+	__m256i u = _mm256_xor_si256(a, b);
+
+	*h = _mm256_or_si256(_mm256_and_si256(a, b), _mm256_and_si256(u, c));
+	*l = _mm256_xor_si256(u, c);
+}
+
+#define LD(i) _mm256_loadu_si256((const __m256i *)&w[(i) * 4])
+
+static uint64_t
+popcount_hs(const uint64_t *w, size_t nvec)
+{
+	__m256i total = _mm256_setzero_si256();
+	__m256i ones = total, twos = total, fours = total, eights = total, sixteens;
+	__m256i twosA, twosB, foursA, foursB, eightsA, eightsB;
+	uint64_t r[4];
+	size_t i;
+
+	for (i = 0; i + 16 <= nvec; i += 16, w += 64) {
+		csa256(&twosA, &ones, ones, LD(0), LD(1));
+		csa256(&twosB, &ones, ones, LD(2), LD(3));
+		csa256(&foursA, &twos, twos, twosA, twosB);
+		csa256(&twosA, &ones, ones, LD(4), LD(5));
+		csa256(&twosB, &ones, ones, LD(6), LD(7));
+		csa256(&foursB, &twos, twos, twosA, twosB);
+		csa256(&eightsA, &fours, fours, foursA, foursB);
+		csa256(&twosA, &ones, ones, LD(8), LD(9));
+		csa256(&twosB, &ones, ones, LD(10), LD(11));
+		csa256(&foursA, &twos, twos, twosA, twosB);
+		csa256(&twosA, &ones, ones, LD(12), LD(13));
+		csa256(&twosB, &ones, ones, LD(14), LD(15));
+		csa256(&foursB, &twos, twos, twosA, twosB);
+		csa256(&eightsB, &fours, fours, foursA, foursB);
+		csa256(&sixteens, &eights, eights, eightsA, eightsB);
+		total = _mm256_add_epi64(total, popcount256(sixteens));
+	}
+	total = _mm256_slli_epi64(total, 4);
+	total = _mm256_add_epi64(total, _mm256_slli_epi64(popcount256(eights), 3));
+	total = _mm256_add_epi64(total, _mm256_slli_epi64(popcount256(fours), 2));
+	total = _mm256_add_epi64(total, _mm256_slli_epi64(popcount256(twos), 1));
+	total = _mm256_add_epi64(total, popcount256(ones));
+	for (; i < nvec; i++, w += 4)
+		total = _mm256_add_epi64(total, popcount256(LD(0)));
+	_mm256_storeu_si256((__m256i *)r, total);
+	return r[0] + r[1] + r[2] + r[3];
+}
+#undef LD
+#endif
+
+static uint64_t
+popcount_words(const uint64_t *w, size_t n)
+{
+	uint64_t c = 0;
+	size_t i = 0;
+
+#ifdef __AVX2__
+	if (n >= 64) {
+		c = popcount_hs(w, n / 4);
+		i = n & ~(size_t)3;
+	}
+#endif
+	for (; i < n; i++)
+		c += __builtin_popcountll(w[i]);
+	return c;
+}
+
+/* Number of set bits [lo, hi) in an array of words. */
+static uint64_t
+words_count_range(const uint64_t *w, uint64_t lo, uint64_t hi)
+{
+	uint64_t lw = lo >> 6, hw = (hi - 1) >> 6;
+	uint64_t lm = ~0ULL << (lo & 63), hm = ~0ULL >> (63 - ((hi - 1) & 63));
+
+	if (lo >= hi)
+		return 0;
+	if (lw == hw)
+		return __builtin_popcountll(w[lw] & lm & hm);
+	return __builtin_popcountll(w[lw] & lm) +
+	    popcount_words(&w[lw + 1], hw - lw - 1) +
+	    __builtin_popcountll(w[hw] & hm);
+}
+
+/*
+ * End of the run of set bits that contains bit b in an array of nw
+ * words: the first clear bit after b, or nw * 64 if there is none.
+ * Whole words are compared with all ones, four at a time with AVX2.
+ */
+static uint64_t
+words_run_end(const uint64_t *w, uint64_t b, uint64_t nw)
+{
+	uint64_t i = b >> 6;
+	uint64_t m = ~w[i] & (~0ULL << (b & 63));
+
+	if (m)
+		return (i << 6) + __builtin_ctzll(m);
+	i++;
+#ifdef __AVX2__
+	for (; i + 4 <= nw; i += 4)
+		if (!_mm256_testc_si256(_mm256_loadu_si256((const __m256i *)&w[i]), _mm256_set1_epi64x(-1)))
+			break;
+#endif
+	for (; i < nw; i++)
+		if (w[i] != ~0ULL)
+			return (i << 6) + __builtin_ctzll(~w[i]);
+	return nw << 6;
+}
+
+/*
+ * Memory usage.
+ *
+ * allocated is what we asked malloc for. resident is how much of it
+ * has been written to: the words that aren't zero, and for big
+ * allocations the pages that have a word that isn't zero since that
+ * is what the kernel has to back if the memory came straight from
+ * mmap. We don't ask mincore because calloc often hands out memory
+ * that was used and freed before and is all in memory anyway.
+ * Allocations that we clear ourselves with memset are written to all
+ * over and are added with mem_add_touched instead.
+ */
+#define MEM_PAGE_MIN (256 * 1024)
+#define MEM_PAGE 4096
+
+/* Is the range [s, e) all zeroes? Whole words first, the tail by byte. */
+static bool
+mem_zero(uintptr_t s, uintptr_t e)
+{
+	const uint64_t *w = (const uint64_t *)s;
+	const uint64_t *we = (const uint64_t *)(s + ((e - s) & ~(uintptr_t)7));
+	const unsigned char *c;
+
+	for (; w < we; w++)
+		if (*w)
+			return false;
+	for (c = (const unsigned char *)we; c < (const unsigned char *)e; c++)
+		if (*c)
+			return false;
+	return true;
+}
+
+static size_t
+mem_resident(const void *p, size_t sz)
+{
+	uintptr_t s = (uintptr_t)p, e = s + sz;
+	size_t r = 0;
+
+	if (sz >= MEM_PAGE_MIN) {
+		uintptr_t pg = s & ~(uintptr_t)(MEM_PAGE - 1);
+
+		for (; pg < e; pg += MEM_PAGE)
+			if (!mem_zero(pg > s ? pg : s, pg + MEM_PAGE < e ? pg + MEM_PAGE : e))
+				r += MEM_PAGE;
+		return r < sz ? r : sz;
+	}
+	for (; s + sizeof(uint64_t) <= e; s += sizeof(uint64_t))
+		if (*(const uint64_t *)s)
+			r += sizeof(uint64_t);
+	if (!mem_zero(s, e))
+		r += e - s;
+	return r;
+}
+
+/* Add one allocation of sz bytes at p to mu. */
+static void
+mem_add(struct bmap_mem_usage *mu, const void *p, size_t sz)
+{
+	mu->allocated += sz;
+	mu->resident += mem_resident(p, sz);
+}
+
+/* Add one allocation of sz bytes that has been written to all over. */
+static void
+mem_add_touched(struct bmap_mem_usage *mu, size_t sz)
+{
+	mu->allocated += sz;
+	mu->resident += sz;
+}
+
 struct simple_bmap {
 	unsigned int sz;
 	uint64_t data[];
 };
 
+static size_t
+simple_alloc_size(size_t nbits)
+{
+	return sizeof(struct simple_bmap) + (nbits + 63) / 64 * sizeof(uint64_t);
+}
+
 static void *
 simple_alloc(size_t nbits)
 {
-	struct simple_bmap *bmap = calloc(sizeof(*bmap) + (nbits + 63) / CHAR_BIT, 1);
+	struct simple_bmap *bmap = calloc(simple_alloc_size(nbits), 1);
 	bmap->sz = nbits;
 	return bmap;
 }
 
+static void
+simple_mem_usage(void *v, struct bmap_mem_usage *mu)
+{
+	struct simple_bmap *bmap = v;
+
+	memset(mu, 0, sizeof(*mu));
+	mem_add(mu, bmap, simple_alloc_size(bmap->sz));
+}
+
 #define SIMPLE_SLOT(bit) ((bit) >> 6)
 #define SIMPLE_MASK(bit) (1LLU << ((bit) & ((1 << 6) - 1)))
 #define SIMPLE_SLOT_TO_B(s) ((s) << 6)
@@ -78,7 +394,10 @@ dumb_first_set(void *v, unsigned int b)
 	return BMAP_INVALID_OFF;
 }
 
-struct bmap_interface bmap_dumb = { simple_alloc, free, simple_set, simple_isset, dumb_first_set };
+struct bmap_interface BMAP_IFACE(dumb) = {
+	simple_alloc, free, simple_set, simple_isset, dumb_first_set,
+	.mem_usage = simple_mem_usage,
+};
 
 /*
  * Check each 64 bit slot individually with
@@ -103,7 +422,36 @@ simple_first_set(void *v, unsigned int b)
         return BMAP_INVALID_OFF;
 }
 
-struct bmap_interface bmap_simple = { simple_alloc, free, simple_set, simple_isset, simple_first_set };
+static unsigned int
+simple_count_range(void *v, unsigned int lo, unsigned int hi)
+{
+	struct simple_bmap *bmap = v;
+
+	if (hi > bmap->sz)
+		hi = bmap->sz;
+	return words_count_range(bmap->data, lo, hi);
+}
+
+static bool
+simple_next_run(void *v, unsigned int b, unsigned int *start, unsigned int *end)
+{
+	struct simple_bmap *bmap = v;
+	uint64_t e;
+
+	if (b >= bmap->sz || (b = simple_first_set(v, b)) == BMAP_INVALID_OFF)
+		return false;
+	e = words_run_end(bmap->data, b, SIMPLE_SLOT(bmap->sz + 63));
+	*start = b;
+	*end = e < bmap->sz ? e : bmap->sz;
+	return true;
+}
+
+struct bmap_interface BMAP_IFACE(simple) = {
+	simple_alloc, free, simple_set, simple_isset, simple_first_set,
+	.count_range = simple_count_range,
+	.mem_usage = simple_mem_usage,
+	.next_run = simple_next_run,
+};
 
 
 /*
@@ -119,18 +467,26 @@ struct p64_bmap {
 #define P64_SLOT(b, l) ((uint64_t)SIMPLE_SLOT((b) >> P64_LM(l)))
 #define P64_MASK(b, l) ((uint64_t)SIMPLE_MASK((b) >> P64_LM(l)))
 
-static void *
-p64_alloc(size_t nbits)
+static size_t
+p64_alloc_size(size_t nbits)
 {
-	struct p64_bmap *pb;
 	size_t sz;
 	int l;
 
-	sz = sizeof(*pb);
+	sz = sizeof(struct p64_bmap);
 	for (l = 0; l < 6; l++) {
 		sz += (P64_SLOT(nbits + 63, l) + 1) * sizeof(uint64_t);
 	}
-	pb = calloc(sz, 1);
+	return sz;
+}
+
+static void *
+p64_alloc(size_t nbits)
+{
+	struct p64_bmap *pb;
+	int l;
+
+	pb = calloc(p64_alloc_size(nbits), 1);
 	uint64_t *a = (uint64_t *)(pb + 1);
 	for (l = 0; l < 6; l++) {
 		pb->lvl[l] = a;
@@ -197,7 +553,19 @@ p64_first_set(void *v, unsigned int b)
 	return b;
 }
 
-struct bmap_interface bmap_p64 = { p64_alloc, free, p64_set, p64_isset, p64_first_set };
+static void
+p64_mem_usage(void *v, struct bmap_mem_usage *mu)
+{
+	struct p64_bmap *pb = v;
+
+	memset(mu, 0, sizeof(*mu));
+	mem_add(mu, pb, p64_alloc_size(pb->sz));
+}
+
+struct bmap_interface BMAP_IFACE(p64) = {
+	p64_alloc, free, p64_set, p64_isset, p64_first_set,
+	.mem_usage = p64_mem_usage,
+};
 
 static unsigned int
 p64_first_set_no_l5_peek(void *v, unsigned int b)
@@ -224,7 +592,10 @@ p64_first_set_no_l5_peek(void *v, unsigned int b)
 	return b;
 }
 
-struct bmap_interface bmap_p64_naive = { p64_alloc, free, p64_set, p64_isset, p64_first_set_no_l5_peek };
+struct bmap_interface BMAP_IFACE(p64_naive) = {
+	p64_alloc, free, p64_set, p64_isset, p64_first_set_no_l5_peek,
+	.mem_usage = p64_mem_usage,
+};
 
 static const uint64_t log2_64 = 6;
 static const uint64_t p64v2_levels = 6;
@@ -263,18 +634,26 @@ p64v2_pbslot(struct p64_bmap *pb, uint64_t b, uint64_t l)
 	return &pb->lvl[l][p64v2_slot(b, l)];
 }
 
-static void *
-p64v2_alloc(size_t nbits)
+static size_t
+p64v2_alloc_size(size_t nbits)
 {
-	struct p64_bmap *pb;
 	size_t sz;
 	int l;
 
-	sz = sizeof(*pb);
+	sz = sizeof(struct p64_bmap);
 	for (l = 0; l < 6; l++) {
 		sz += (p64v2_slot(nbits + 63, l) + 1) * sizeof(uint64_t);
 	}
-	pb = calloc(sz, 1);
+	return sz;
+}
+
+static void *
+p64v2_alloc(size_t nbits)
+{
+	struct p64_bmap *pb;
+	int l;
+
+	pb = calloc(p64v2_alloc_size(nbits), 1);
 	uint64_t *a = (uint64_t *)(pb + 1);
 	for (l = 0; l < 6; l++) {
 		pb->lvl[l] = a;
@@ -341,70 +720,52 @@ p64v2_first_set(void *v, unsigned int b)
 	return b;
 }
 
-struct bmap_interface bmap_p64v2 = { p64v2_alloc, free, p64v2_set, p64v2_isset, p64v2_first_set };
-
-struct p64v3_bmap {
-	unsigned int sz;
-	unsigned int levels;
-	uint64_t *lvl[];
-};
-
-/* log2 of how many bits one bit covers at this level. */
-static inline uint64_t
-p64v3_bpb(uint64_t l)
-{
-	return l * log2_64;
-}
-
-/* log2 of how many bits one slot covers at this level. */
-static inline uint64_t
-p64v3_bps(uint64_t l)
+static void
+p64v2_mem_usage(void *v, struct bmap_mem_usage *mu)
 {
-	return (l + 1) * log2_64;
-}
+	struct p64_bmap *pb = v;
 
-static inline uint64_t
-p64v3_slot(uint64_t b, uint64_t l)
-{
-	return b >> p64v3_bps(l);
+	memset(mu, 0, sizeof(*mu));
+	mem_add(mu, pb, p64v2_alloc_size(pb->sz));
 }
 
-static inline uint64_t
-p64v3_mask(uint64_t b, uint64_t l)
-{
-	return 1LLU << ((b >> p64v3_bpb(l)) & ((1 << log2_64) - 1));
-}
+struct bmap_interface BMAP_IFACE(p64v2) = {
+	p64v2_alloc, free, p64v2_set, p64v2_isset, p64v2_first_set,
+	.mem_usage = p64v2_mem_usage,
+};
 
-/* How many slots do we need to cover nbits on this level */
-static inline uint64_t
-p64v3_slots_per_level(uint64_t nbits, uint64_t l)
+/*
+ * Allocate a p64v3 bitmap at offset off in the allocation. This is
+ * for variants that wrap struct p64v3_bmap as the last member of
+ * their own struct, the returned pointer is to the start of it.
+ */
+static size_t
+p64v3_alloc_size(size_t nbits, size_t off)
 {
-	return p64v3_slot(nbits, l) + 1;
-}
+	size_t sz;
+	int l;
+	int levels;
 
-static inline uint64_t *
-p64v3_pbslot(struct p64v3_bmap *pb, uint64_t b, uint64_t l)
-{
-	return &pb->lvl[l][p64v3_slot(b, l)];
+	levels = p64v3_levels(nbits);
+	sz = off + sizeof(struct p64v3_bmap);
+	for (l = 0; l < levels; l++) {
+		sz += p64v3_slots_per_level(nbits, l) * sizeof(uint64_t);
+	}
+	sz += levels * sizeof(uint64_t **);
+	return sz;
 }
 
 static void *
-p64v3_alloc(size_t nbits)
+p64v3_alloc_off(size_t nbits, size_t off)
 {
 	struct p64v3_bmap *pb;
-	size_t sz;
 	int l;
 	int levels;
+	char *base;
 
-	for (levels = 0; p64v3_slots_per_level(nbits, levels) > 1; levels++)
-		;
-	sz = sizeof(*pb);
-	levels++;
-	for (l = 0; l < levels; l++) {
-		sz += p64v3_slots_per_level(nbits, l) * sizeof(uint64_t);
-	}
-	sz += levels * sizeof(uint64_t **);
-	pb = calloc(sz, 1);
+	levels = p64v3_levels(nbits);
+	base = calloc(p64v3_alloc_size(nbits, off), 1);
+	pb = (struct p64v3_bmap *)(base + off);
 	uint64_t *a = (uint64_t *)&pb->lvl[levels];
 	for (l = 0; l < levels; l++) {
 		pb->lvl[l] = a;
@@ -412,7 +773,22 @@ p64v3_alloc(size_t nbits)
 	}
 	pb->sz = nbits;
 	pb->levels = levels;
-	return pb;
+	return base;
+}
+
+static void *
+p64v3_alloc(size_t nbits)
+{
+	return p64v3_alloc_off(nbits, 0);
+}
+
+static void
+p64v3_mem_usage(void *v, struct bmap_mem_usage *mu)
+{
+	struct p64v3_bmap *pb = v;
+
+	memset(mu, 0, sizeof(*mu));
+	mem_add(mu, pb, p64v3_alloc_size(pb->sz, 0));
 }
 
 static void
@@ -450,49 +826,38 @@ p64v3_first_set(void *v, unsigned int b)
 	 */
 	slot = p64v3_slot(b, 0);
 	masked = ~(p64v3_mask(b, 0) - 1) & pb->lvl[0][slot];
+	FS_WORD(0);
 	b = slot << log2_64;
 	if (masked)
 		return b + __builtin_ffsll(masked) - 1;
 	b += 64;
+	if (b > pb->sz)
+		return BMAP_INVALID_OFF;
 
 	for (l = pb->levels - 1; l >= 0; l--) {
 		slot = p64v3_slot(b, l);
 		masked = ~(p64v3_mask(b, l) - 1) & pb->lvl[l][slot];
+		FS_WORD(l);
 		if (masked) {
 			unsigned int min = ((slot << log2_64) + __builtin_ffsll(masked) - 1) << p64v3_bpb(l);
 			if (min > b)
 				b = min;
+			if (l > 0)
+				FS_DESCEND();
 		} else {
 			if (l == pb->levels - 1)
 				return BMAP_INVALID_OFF;
 			b = (slot + 1) << p64v3_bps(l);
+			if (b > pb->sz)
+				return BMAP_INVALID_OFF;
+			FS_CLIMB();
 			l += 2;
 		}
 	}
 	return b;
 }
 
-struct bmap_interface bmap_p64v3 = { p64v3_alloc, free, p64v3_set, p64v3_isset, p64v3_first_set };
-
-static unsigned int
-p64v3_first_set_r(struct p64v3_bmap *pb, uint64_t b, uint64_t l)
-{
-	uint64_t slot = p64v3_slot(b, l);
-	uint64_t masked = ~(p64v3_mask(b, l) - 1) & pb->lvl[l][slot];
-	if (masked) {
-		uint64_t m = ((slot << log2_64) + __builtin_ffsll(masked) - 1) << p64v3_bpb(l);
-		if (l == 0)
-			return m;
-		if (m > b)
-			b = m;
-		return p64v3_first_set_r(pb, b, l - 1);
-	} else {
-		if (l == pb->levels - 1)
-			return BMAP_INVALID_OFF;
-		b = (slot + 1) << p64v3_bps(l);
-		return p64v3_first_set_r(pb, b, l + 1);
-	}
-}
+FS_INSTRUMENT(p64v3_first_set)
 
 static unsigned int
 p64v3r_first_set(void *v, unsigned int b)
@@ -503,91 +868,773 @@ p64v3r_first_set(void *v, unsigned int b)
 	return p64v3_first_set_r(pb, b, 0);
 }
 
-struct bmap_interface bmap_p64v3r = { p64v3_alloc, free, p64v3_set, p64v3_isset, p64v3r_first_set };
-
-static unsigned int
-p64v3r2_first_set(void *v, unsigned int b)
-{
-	struct p64v3_bmap *pb = v;
-	unsigned int slot;
-	uint64_t masked;
-
-	if (b > pb->sz)
-		return BMAP_INVALID_OFF;
+FS_INSTRUMENT(p64v3r_first_set)
 
-	/*
-	 * quick check for the initial lvl 0 slot being populated.
-	 * This saves a lot of effort in very dense bitmaps.
-	 */
-	slot = p64v3_slot(b, 0);
-	masked = ~(p64v3_mask(b, 0) - 1) & pb->lvl[0][slot];
-	b = slot << log2_64;
-	if (masked)
-		return b + __builtin_ffsll(masked) - 1;
-	b += 64;
-	return p64v3_first_set_r(pb, b, pb->levels - 1);
-}
+struct bmap_interface BMAP_IFACE(p64v3r) = {
+	p64v3_alloc, free, p64v3_set, p64v3_isset, FS(p64v3r_first_set),
+	.mem_usage = p64v3_mem_usage,
+};
 
-struct bmap_interface bmap_p64v3r2 = { p64v3_alloc, free, p64v3_set, p64v3_isset, p64v3r2_first_set };
+/*
+ * Range operations.
+ *
+ * A range of bits at one level maps to the range of words containing
+ * them, which is a range of bits at the level above. So we fill
+ * whole words at each level and walk up with the range shrinking 64
+ * times per level. Setting a million bits is 16k word stores in the
+ * bitmap, 245 at level 1 and a handful above that.
+ */
 
-static unsigned int
-p64v3r3_first_set(void *v, unsigned int b)
+/* Set bits [lo, hi) in an array of words. */
+static void
+words_set_range(uint64_t *w, uint64_t lo, uint64_t hi)
 {
-	struct p64v3_bmap *pb = v;
-	unsigned int slot;
-	uint64_t masked;
-
-	if (b > pb->sz)
-		return BMAP_INVALID_OFF;
+	uint64_t lw = lo >> log2_64, hw = (hi - 1) >> log2_64;
+	uint64_t lm = ~0ULL << (lo & 63), hm = ~0ULL >> (63 - ((hi - 1) & 63));
 
-	/*
-	 * quick check for the initial lvl 0 slot being populated.
-	 * This saves a lot of effort in very dense bitmaps.
-	 */
-	slot = p64v3_slot(b, 0);
-	masked = ~(p64v3_mask(b, 0) - 1) & pb->lvl[0][slot];
-	b = slot << log2_64;
-	if (masked)
-		return b + __builtin_ffsll(masked) - 1;
-	b += 64;
-	if (b > pb->sz)
-		return BMAP_INVALID_OFF;
-	return p64v3_first_set_r(pb, b, 1);
+	if (lw == hw) {
+		w[lw] |= lm & hm;
+		return;
+	}
+	w[lw] |= lm;
+	memset(&w[lw + 1], 0xff, (hw - lw - 1) * sizeof(*w));
+	w[hw] |= hm;
 }
 
-struct bmap_interface bmap_p64v3r3 = { p64v3_alloc, free, p64v3_set, p64v3_isset, p64v3r3_first_set };
+/* Clear bits [lo, hi) in an array of words. */
+static void
+words_clear_range(uint64_t *w, uint64_t lo, uint64_t hi)
+{
+	uint64_t lw = lo >> log2_64, hw = (hi - 1) >> log2_64;
+	uint64_t lm = ~0ULL << (lo & 63), hm = ~0ULL >> (63 - ((hi - 1) & 63));
 
+	if (lw == hw) {
+		w[lw] &= ~(lm & hm);
+		return;
+	}
+	w[lw] &= ~lm;
+	memset(&w[lw + 1], 0, (hw - lw - 1) * sizeof(*w));
+	w[hw] &= ~hm;
+}
 
 static void
-p64v3switch_set(void *v, unsigned int b)
+p64v3_set_range(void *v, unsigned int lo, unsigned int hi)
 {
 	struct p64v3_bmap *pb = v;
-
-	switch (pb->levels) {
-	case 6:
-		*p64v3_pbslot(pb, b, 5) |= p64v3_mask(b, 5);
-	case 5:
-		*p64v3_pbslot(pb, b, 4) |= p64v3_mask(b, 4);
-	case 4:
-		*p64v3_pbslot(pb, b, 3) |= p64v3_mask(b, 3);
-	case 3:
-		*p64v3_pbslot(pb, b, 2) |= p64v3_mask(b, 2);
-	case 2:
-		*p64v3_pbslot(pb, b, 1) |= p64v3_mask(b, 1);
-	case 1:
-		*p64v3_pbslot(pb, b, 0) |= p64v3_mask(b, 0);
+	uint64_t l, b = lo, e = hi;
+
+	if (e > pb->sz)
+		e = pb->sz;
+	for (l = 0; l < pb->levels && b < e; l++) {
+		words_set_range(pb->lvl[l], b, e);
+		b = b >> log2_64;
+		e = ((e - 1) >> log2_64) + 1;
 	}
 }
 
-struct bmap_interface bmap_p64v3switch = { p64v3_alloc, free, p64v3switch_set, p64v3_isset, p64v3r_first_set };
-
 static void
-p64v3jump_set(void *v, unsigned int b)
+p64v3_clear_range(void *v, unsigned int lo, unsigned int hi)
 {
 	struct p64v3_bmap *pb = v;
-	static const void * const ls[7] = {
-		NULL,
-		&&l_1,
+	uint64_t l, b = lo, e = hi;
+
+	if (e > pb->sz)
+		e = pb->sz;
+	for (l = 0; l < pb->levels && b < e; l++) {
+		uint64_t *w = pb->lvl[l];
+
+		words_clear_range(w, b, e);
+		/*
+		 * Words in the middle are now zero, so are their bits
+		 * in the level above. The first and last word were
+		 * only partially cleared and keep their bit if they
+		 * still have something in them.
+		 */
+		b = b >> log2_64;
+		e = ((e - 1) >> log2_64) + 1;
+		if (w[b])
+			b++;
+		if (e > b && w[e - 1])
+			e--;
+	}
+}
+
+static bool
+p64v3_any_in_range(void *v, unsigned int lo, unsigned int hi)
+{
+	struct p64v3_bmap *pb = v;
+
+	if (lo >= hi || lo > pb->sz)
+		return false;
+	return p64v3_first_set_r(pb, lo, 0) < hi;
+}
+
+static bool
+p64v3_all_in_range(void *v, unsigned int lo, unsigned int hi)
+{
+	struct p64v3_bmap *pb = v;
+	uint64_t *w = pb->lvl[0];
+	uint64_t lw, hw, lm, hm, i;
+
+	if (lo >= hi)
+		return true;
+	if (hi > pb->sz)
+		return false;
+	lw = lo >> log2_64;
+	hw = (hi - 1) >> log2_64;
+	lm = ~0ULL << (lo & 63);
+	hm = ~0ULL >> (63 - ((hi - 1) & 63));
+	if (lw == hw)
+		return (w[lw] & (lm & hm)) == (lm & hm);
+	if ((w[lw] & lm) != lm || (w[hw] & hm) != hm)
+		return false;
+	for (i = lw + 1; i < hw; i++)
+		if (w[i] != ~0ULL)
+			return false;
+	return true;
+}
+
+/*
+ * Counting.
+ *
+ * p64v3_count_down counts the bitmap bits under a range of bits of
+ * level l by walking the runs of set bits and recursing into the
+ * words they cover on the level below. Zero words never get touched
+ * and a run of non-zero bitmap words becomes one popcount_words call.
+ *
+ * p64v3_count_up peels off the partial words at the edges of the
+ * range and moves the whole words in the middle up one level so that
+ * we skip big zero areas without reading them.
+ */
+static uint64_t
+p64v3_count_down(struct p64v3_bmap *pb, uint64_t l, uint64_t lo, uint64_t hi)
+{
+	uint64_t *w = pb->lvl[l];
+	uint64_t i, n = 0;
+
+	if (lo >= hi)
+		return 0;
+	if (l == 0)
+		return words_count_range(w, lo, hi);
+	for (i = lo >> log2_64; i <= (hi - 1) >> log2_64; i++) {
+		uint64_t m = w[i];
+
+		if (i == lo >> log2_64)
+			m &= ~0ULL << (lo & 63);
+		if (i == (hi - 1) >> log2_64)
+			m &= ~0ULL >> (63 - ((hi - 1) & 63));
+		if (l == 1 && m) {
+			/*
+			 * When most of the bitmap words under this word
+			 * are populated it's cheaper to count them all
+			 * in one go than to split them into runs.
+			 */
+			uint64_t s = __builtin_ctzll(m), e = 64 - __builtin_clzll(m);
+
+			if (__builtin_popcountll(m) * 4 >= e - s) {
+				n += popcount_words(&pb->lvl[0][(i << log2_64) + s], e - s);
+				continue;
+			}
+		}
+		while (m) {
+			uint64_t s = __builtin_ctzll(m);
+			uint64_t e = (m >> s) == ~0ULL ? 64 : s + __builtin_ctzll(~(m >> s));
+
+			n += p64v3_count_down(pb, l - 1, ((i << log2_64) + s) << log2_64, ((i << log2_64) + e) << log2_64);
+			m = e == 64 ? 0 : m & (~0ULL << e);
+		}
+	}
+	return n;
+}
+
+static uint64_t
+p64v3_count_up(struct p64v3_bmap *pb, uint64_t l, uint64_t lo, uint64_t hi)
+{
+	uint64_t a = (lo + 63) & ~63ULL, b = hi & ~63ULL;
+
+	if (l == pb->levels - 1 || a >= b)
+		return p64v3_count_down(pb, l, lo, hi);
+	return p64v3_count_down(pb, l, lo, a) +
+	    p64v3_count_up(pb, l + 1, a >> log2_64, b >> log2_64) +
+	    p64v3_count_down(pb, l, b, hi);
+}
+
+static unsigned int
+p64v3_count_range(void *v, unsigned int lo, unsigned int hi)
+{
+	struct p64v3_bmap *pb = v;
+
+	if (hi > pb->sz)
+		hi = pb->sz;
+	return p64v3_count_up(pb, 0, lo, hi);
+}
+
+/* A full copy, to compare p64v3cow with. */
+static void *
+p64v3_clone(void *v)
+{
+	struct p64v3_bmap *pb = v;
+	struct p64v3_bmap *c = p64v3_alloc(pb->sz);
+	int l;
+
+	for (l = 0; l < pb->levels; l++)
+		memcpy(c->lvl[l], pb->lvl[l], p64v3_slots_per_level(pb->sz, l) * sizeof(uint64_t));
+	return c;
+}
+
+/*
+ * Elias-Fano.
+ *
+ * A read only encoding of the set, made with freeze from p64v3. Each
+ * element x is split into l low bits, stored as is in a packed array,
+ * and the high bits h = x >> l, stored in unary in the upper bit
+ * vector as a one at h + i where i is the index of the element. So
+ * the elements with high bits h are the ones between zero number
+ * h - 1 and zero number h. With l = log2(universe / n) this takes
+ * 2 + log2(universe / n) bits per element, close to the minimum for
+ * a set of n elements.
+ *
+ * first_set(b) finds the start of the bucket b >> l with a select0
+ * on the upper bits and scans from there. To make select0 fast we
+ * keep the position of every 256th zero.
+ */
+#define EF_SAMPLE_SHIFT 8
+
+struct ef_bmap {
+	unsigned int sz;
+	unsigned int n;
+	unsigned int l;
+	unsigned int nbuckets;		/* zeros in upper */
+	size_t allocated;
+	uint64_t *low;
+	uint64_t *upper;
+	unsigned int *zsamp;		/* position of zero number i << EF_SAMPLE_SHIFT */
+};
+
+/* Position of set bit number r in w. */
+static inline unsigned int
+select64(uint64_t w, unsigned int r)
+{
+#ifdef __BMI2__
+	return __builtin_ctzll(_pdep_u64(1ULL << r, w));
+#else
+	while (r--)
+		w &= w - 1;
+	return __builtin_ctzll(w);
+#endif
+}
+
+static struct ef_bmap *
+ef_alloc_n(size_t nbits, size_t n)
+{
+	struct ef_bmap *ef;
+	size_t u = nbits ? nbits : 1;
+	size_t nlow, nupper, nsamp, sz;
+	unsigned int l = 0;
+
+	if (n && u / n > 1)
+		l = 63 - __builtin_clzll(u / n);
+	nlow = (n * l + 63) / 64 + 1;
+	nupper = (n + ((u - 1) >> l) + 1 + 63) / 64 + 1;
+	nsamp = ((((u - 1) >> l) + 1) >> EF_SAMPLE_SHIFT) + 1;
+	sz = sizeof(*ef) + (nlow + nupper) * sizeof(uint64_t) + nsamp * sizeof(unsigned int);
+	ef = calloc(sz, 1);
+	ef->sz = nbits;
+	ef->n = n;
+	ef->l = l;
+	ef->nbuckets = ((u - 1) >> l) + 1;
+	ef->allocated = sz;
+	ef->low = (uint64_t *)(ef + 1);
+	ef->upper = ef->low + nlow;
+	ef->zsamp = (unsigned int *)(ef->upper + nupper);
+	return ef;
+}
+
+/* Add element number i, must be called in order. */
+static void
+ef_push(struct ef_bmap *ef, uint64_t i, uint64_t x)
+{
+	uint64_t h = (x >> ef->l) + i;
+
+	ef->upper[h >> 6] |= 1ULL << (h & 63);
+	if (ef->l) {
+		uint64_t lb = x & ((1ULL << ef->l) - 1);
+		uint64_t o = i * ef->l;
+
+		ef->low[o >> 6] |= lb << (o & 63);
+		if ((o & 63) + ef->l > 64)
+			ef->low[(o >> 6) + 1] |= lb >> (64 - (o & 63));
+	}
+}
+
+/* Build the select0 samples once all elements are pushed. */
+static void
+ef_finish(struct ef_bmap *ef)
+{
+	uint64_t nbits = (uint64_t)ef->n + ef->nbuckets;
+	uint64_t zeros = 0, next = 0, wi;
+
+	for (wi = 0; wi < (nbits + 63) / 64; wi++) {
+		uint64_t z = ~ef->upper[wi];
+		uint64_t c;
+
+		if (wi == nbits / 64)
+			z &= (1ULL << (nbits & 63)) - 1;
+		c = __builtin_popcountll(z);
+		while (next < zeros + c) {
+			ef->zsamp[next >> EF_SAMPLE_SHIFT] = wi * 64 + select64(z, next - zeros);
+			next += 1 << EF_SAMPLE_SHIFT;
+		}
+		zeros += c;
+	}
+}
+
+static inline uint64_t
+ef_low(struct ef_bmap *ef, uint64_t i)
+{
+	uint64_t o = i * ef->l;
+	uint64_t v;
+
+	if (ef->l == 0)
+		return 0;
+	v = ef->low[o >> 6] >> (o & 63);
+	if ((o & 63) + ef->l > 64)
+		v |= ef->low[(o >> 6) + 1] << (64 - (o & 63));
+	return v & ((1ULL << ef->l) - 1);
+}
+
+/* Position of zero number j in upper. */
+static inline uint64_t
+ef_select0(struct ef_bmap *ef, uint64_t j)
+{
+	uint64_t p = ef->zsamp[j >> EF_SAMPLE_SHIFT];
+	uint64_t r = j & ((1 << EF_SAMPLE_SHIFT) - 1);
+	uint64_t wi = p >> 6;
+	uint64_t z = ~ef->upper[wi] & (~0ULL << (p & 63));
+	uint64_t c;
+
+	while (r >= (c = __builtin_popcountll(z))) {
+		r -= c;
+		z = ~ef->upper[++wi];
+	}
+	return wi * 64 + select64(z, r);
+}
+
+static void *
+ef_alloc(size_t nbits)
+{
+	struct ef_bmap *ef = ef_alloc_n(nbits, 0);
+
+	ef_finish(ef);
+	return ef;
+}
+
+/* Read only. */
+static void
+ef_set(void *v, unsigned int b)
+{
+	abort();
+}
+
+static unsigned int
+ef_first_set(void *v, unsigned int b)
+{
+	struct ef_bmap *ef = v;
+	uint64_t h = b >> ef->l;
+	uint64_t pos, i, wi, w, x;
+
+	if (b > ef->sz || h >= ef->nbuckets)
+		return BMAP_INVALID_OFF;
+	pos = h ? ef_select0(ef, h - 1) + 1 : 0;
+	/* Number of ones before pos. */
+	i = pos - h;
+	while (i < ef->n) {
+		/* Skip zeros to the next element, i doesn't change. */
+		wi = pos >> 6;
+		w = ef->upper[wi] & (~0ULL << (pos & 63));
+		while (w == 0)
+			w = ef->upper[++wi];
+		pos = wi * 64 + __builtin_ctzll(w);
+		x = ((pos - i) << ef->l) | ef_low(ef, i);
+		if (x >= b)
+			return x;
+		pos++;
+		i++;
+	}
+	return BMAP_INVALID_OFF;
+}
+
+static bool
+ef_isset(void *v, unsigned int b)
+{
+	return ef_first_set(v, b) == b;
+}
+
+static void
+ef_mem_usage(void *v, struct bmap_mem_usage *mu)
+{
+	struct ef_bmap *ef = v;
+
+	memset(mu, 0, sizeof(*mu));
+	mem_add(mu, ef, ef->allocated);
+}
+
+struct bmap_interface BMAP_IFACE(ef) = {
+	ef_alloc, free, ef_set, ef_isset, ef_first_set,
+	.mem_usage = ef_mem_usage,
+};
+
+static void *
+p64v3_freeze(void *v)
+{
+	struct p64v3_bmap *pb = v;
+	struct ef_bmap *ef = ef_alloc_n(pb->sz, p64v3_count_range(v, 0, pb->sz));
+	uint64_t wi, i = 0;
+
+	for (wi = 0; wi < p64v3_slots_per_level(pb->sz, 0); wi++) {
+		uint64_t w = pb->lvl[0][wi];
+
+		while (w) {
+			ef_push(ef, i++, (wi << log2_64) + __builtin_ctzll(w));
+			w &= w - 1;
+		}
+	}
+	ef_finish(ef);
+	return ef;
+}
+
+/*
+ * Union of many bitmaps.
+ *
+ * The universe is split into chunks of what one level 2 word covers,
+ * 2^18 bits or 32kB of bitmap. Chunks are handed out to a pool of
+ * threads, each chunk is ORed together from all inputs in one go so
+ * that the output stays in cache while the inputs stream through.
+ * Inputs where the level 2 word is zero are skipped and of the rest
+ * only the leaf words with a set level 1 bit are read. Level 1 of
+ * the output is the OR of the inputs' level 1, the levels above are
+ * ORed together once all chunks are done.
+ *
+ * The pool is started on first use with one thread less than the
+ * number of cpus since the caller works too. One union at a time.
+ */
+#define UNION_CHUNK_WORDS 64		/* level 1 words per chunk */
+#define UNION_MAXTHREADS 64
+
+struct union_job {
+	struct p64v3_bmap *out;
+	struct p64v3_bmap **in;
+	size_t n;
+	unsigned int nchunks;
+	unsigned int next;		/* next chunk to do */
+};
+
+static struct {
+	pthread_once_t once;
+	pthread_mutex_t call;		/* one union at a time */
+	pthread_mutex_t mtx;
+	pthread_cond_t work;
+	pthread_cond_t done;
+	struct union_job *job;
+	unsigned long gen;		/* bumped for every job */
+	int nthreads;
+	int busy;
+} upool = {
+	PTHREAD_ONCE_INIT, PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
+	PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER,
+};
+
+static void
+p64v3_union_chunk(struct union_job *j, uint64_t c)
+{
+	struct p64v3_bmap *out = j->out;
+	uint64_t lo = c * UNION_CHUNK_WORDS;
+	uint64_t hi = lo + UNION_CHUNK_WORDS;
+	uint64_t w1;
+	size_t i;
+
+	if (hi > p64v3_slots_per_level(out->sz, 1))
+		hi = p64v3_slots_per_level(out->sz, 1);
+	for (i = 0; i < j->n; i++) {
+		struct p64v3_bmap *in = j->in[i];
+
+		if (in->levels > 2 && in->lvl[2][c] == 0)
+			continue;
+		for (w1 = lo; w1 < hi; w1++) {
+			uint64_t s = in->lvl[1][w1];
+
+			out->lvl[1][w1] |= s;
+			while (s) {
+				uint64_t w0 = (w1 << log2_64) + __builtin_ctzll(s);
+
+				out->lvl[0][w0] |= in->lvl[0][w0];
+				s &= s - 1;
+			}
+		}
+	}
+}
+
+static void
+p64v3_union_run(struct union_job *j)
+{
+	unsigned int c;
+
+	while ((c = __atomic_fetch_add(&j->next, 1, __ATOMIC_RELAXED)) < j->nchunks)
+		p64v3_union_chunk(j, c);
+}
+
+static void *
+p64v3_union_worker(void *arg)
+{
+	unsigned long seen = 0;
+	struct union_job *j;
+
+	pthread_mutex_lock(&upool.mtx);
+	for (;;) {
+		while (upool.gen == seen)
+			pthread_cond_wait(&upool.work, &upool.mtx);
+		seen = upool.gen;
+		j = upool.job;
+		pthread_mutex_unlock(&upool.mtx);
+		p64v3_union_run(j);
+		pthread_mutex_lock(&upool.mtx);
+		if (--upool.busy == 0)
+			pthread_cond_signal(&upool.done);
+	}
+	return NULL;
+}
+
+static void
+p64v3_union_pool_init(void)
+{
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	pthread_t t;
+	int i;
+
+	if (ncpu > UNION_MAXTHREADS)
+		ncpu = UNION_MAXTHREADS;
+	for (i = 0; i < ncpu - 1; i++) {
+		if (pthread_create(&t, NULL, p64v3_union_worker, NULL))
+			break;
+		pthread_detach(t);
+		upool.nthreads++;
+	}
+}
+
+static void *
+p64v3_union_many(void **v, size_t n)
+{
+	struct p64v3_bmap **in = (struct p64v3_bmap **)v;
+	struct p64v3_bmap *out;
+	struct union_job j = { NULL, in, n, 0, 0 };
+	uint64_t w;
+	size_t i;
+	int l;
+
+	/* No size to give the result. */
+	if (n == 0)
+		return NULL;
+	j.out = out = p64v3_alloc(in[0]->sz);
+	for (i = 0; i < n; i++)
+		assert(in[i]->sz == out->sz);
+
+	if (out->levels < 2) {
+		for (i = 0; i < n; i++)
+			out->lvl[0][0] |= in[i]->lvl[0][0];
+		return out;
+	}
+
+	j.nchunks = (p64v3_slots_per_level(out->sz, 1) + UNION_CHUNK_WORDS - 1) / UNION_CHUNK_WORDS;
+	pthread_once(&upool.once, p64v3_union_pool_init);
+	pthread_mutex_lock(&upool.call);
+	pthread_mutex_lock(&upool.mtx);
+	upool.job = &j;
+	upool.busy = upool.nthreads;
+	upool.gen++;
+	pthread_cond_broadcast(&upool.work);
+	pthread_mutex_unlock(&upool.mtx);
+
+	p64v3_union_run(&j);
+
+	pthread_mutex_lock(&upool.mtx);
+	while (upool.busy)
+		pthread_cond_wait(&upool.done, &upool.mtx);
+	pthread_mutex_unlock(&upool.mtx);
+	pthread_mutex_unlock(&upool.call);
+
+	for (l = 2; l < out->levels; l++)
+		for (i = 0; i < n; i++)
+			for (w = 0; w < p64v3_slots_per_level(out->sz, l); w++)
+				out->lvl[l][w] |= in[i]->lvl[l][w];
+	return out;
+}
+
+/*
+ * Set many bits in random order.
+ *
+ * One set per bit means a cache and TLB miss per bit on every level
+ * of a big bitmap. Instead we sort the bits into buckets of what one
+ * level 2 word covers (2^18 bits, 32kB of bitmap) with a counting
+ * sort, set the bitmap and level 1 bits of one bucket at a time while
+ * they're in cache and then set the level 2 word and the levels above
+ * once per bucket. Not worth it if there are fewer bits than buckets.
+ */
+static void
+p64v3_set_batch(void *v, const unsigned int *b, size_t n)
+{
+	struct p64v3_bmap *pb = v;
+	uint64_t nbuckets = p64v3_slots_per_level(pb->sz, 2);
+	unsigned int *cnt, *sorted;
+	uint64_t c, start;
+	size_t i;
+	int l;
+
+	if (pb->levels < 3 || n < nbuckets) {
+		for (i = 0; i < n; i++)
+			p64v3_set(v, b[i]);
+		return;
+	}
+
+	cnt = calloc(nbuckets + 1, sizeof(*cnt));
+	sorted = malloc(n * sizeof(*sorted));
+	for (i = 0; i < n; i++)
+		cnt[p64v3_slot(b[i], 2) + 1]++;
+	for (c = 1; c <= nbuckets; c++)
+		cnt[c] += cnt[c - 1];
+	for (i = 0; i < n; i++)
+		sorted[cnt[p64v3_slot(b[i], 2)]++] = b[i];
+
+	/* cnt[c] is now the end of bucket c. */
+	for (start = 0, c = 0; c < nbuckets; start = cnt[c++]) {
+		uint64_t m2 = 0;
+
+		if (start == cnt[c])
+			continue;
+		for (i = start; i < cnt[c]; i++) {
+			*p64v3_pbslot(pb, sorted[i], 0) |= p64v3_mask(sorted[i], 0);
+			*p64v3_pbslot(pb, sorted[i], 1) |= p64v3_mask(sorted[i], 1);
+			m2 |= p64v3_mask(sorted[i], 2);
+		}
+		pb->lvl[2][c] |= m2;
+		for (l = 3; l < pb->levels; l++)
+			*p64v3_pbslot(pb, sorted[start], l) |= p64v3_mask(sorted[start], l);
+	}
+	free(sorted);
+	free(cnt);
+}
+
+/*
+ * Runs of set bits. The pyramid finds the start of the run, the end
+ * is found on the bitmap level. The summaries only say which words
+ * have something in them, not which are full, so they can't help
+ * with that.
+ */
+static bool
+p64v3_next_run(void *v, unsigned int b, unsigned int *start, unsigned int *end)
+{
+	struct p64v3_bmap *pb = v;
+	uint64_t e;
+
+	if (b >= pb->sz || (b = p64v3_first_set(v, b)) == BMAP_INVALID_OFF)
+		return false;
+	e = words_run_end(pb->lvl[0], b, p64v3_slots_per_level(pb->sz, 0));
+	*start = b;
+	*end = e < pb->sz ? e : pb->sz;
+	return true;
+}
+
+struct bmap_interface BMAP_IFACE(p64v3) = {
+	p64v3_alloc, free, p64v3_set, p64v3_isset, FS(p64v3_first_set),
+	p64v3_set_range, p64v3_clear_range, p64v3_any_in_range, p64v3_all_in_range,
+	p64v3_count_range, p64v3_clone, p64v3_freeze, p64v3_mem_usage,
+	p64v3_union_many, p64v3_set_batch, p64v3_next_run,
+};
+
+static unsigned int
+p64v3r2_first_set(void *v, unsigned int b)
+{
+	struct p64v3_bmap *pb = v;
+	unsigned int slot;
+	uint64_t masked;
+
+	if (b > pb->sz)
+		return BMAP_INVALID_OFF;
+
+	/*
+	 * quick check for the initial lvl 0 slot being populated.
+	 * This saves a lot of effort in very dense bitmaps.
+	 */
+	slot = p64v3_slot(b, 0);
+	masked = ~(p64v3_mask(b, 0) - 1) & pb->lvl[0][slot];
+	FS_WORD(0);
+	b = slot << log2_64;
+	if (masked)
+		return b + __builtin_ffsll(masked) - 1;
+	b += 64;
+	if (b > pb->sz)
+		return BMAP_INVALID_OFF;
+	return p64v3_first_set_r(pb, b, pb->levels - 1);
+}
+
+FS_INSTRUMENT(p64v3r2_first_set)
+
+struct bmap_interface BMAP_IFACE(p64v3r2) = {
+	p64v3_alloc, free, p64v3_set, p64v3_isset, FS(p64v3r2_first_set),
+	.mem_usage = p64v3_mem_usage,
+};
+
+static unsigned int
+p64v3r3_first_set(void *v, unsigned int b)
+{
+	struct p64v3_bmap *pb = v;
+	unsigned int slot;
+	uint64_t masked;
+
+	if (b > pb->sz)
+		return BMAP_INVALID_OFF;
+
+	/*
+	 * quick check for the initial lvl 0 slot being populated.
+	 * This saves a lot of effort in very dense bitmaps.
+	 */
+	slot = p64v3_slot(b, 0);
+	masked = ~(p64v3_mask(b, 0) - 1) & pb->lvl[0][slot];
+	FS_WORD(0);
+	b = slot << log2_64;
+	if (masked)
+		return b + __builtin_ffsll(masked) - 1;
+	b += 64;
+	if (b > pb->sz)
+		return BMAP_INVALID_OFF;
+	return p64v3_first_set_r(pb, b, 1);
+}
+
+FS_INSTRUMENT(p64v3r3_first_set)
+
+struct bmap_interface BMAP_IFACE(p64v3r3) = {
+	p64v3_alloc, free, p64v3_set, p64v3_isset, FS(p64v3r3_first_set),
+	.mem_usage = p64v3_mem_usage,
+};
+
+
+static void
+p64v3switch_set(void *v, unsigned int b)
+{
+	bmap_p64v3switch_set(v, b);
+}
+
+struct bmap_interface BMAP_IFACE(p64v3switch) = {
+	p64v3_alloc, free, p64v3switch_set, p64v3_isset, FS(p64v3r_first_set),
+	.mem_usage = p64v3_mem_usage,
+};
+
+static void
+p64v3jump_set(void *v, unsigned int b)
+{
+	struct p64v3_bmap *pb = v;
+	static const void * const ls[7] = {
+		NULL,
+		&&l_1,
 		&&l_2,
 		&&l_3,
 		&&l_4,
@@ -603,8 +1650,852 @@ l_2:	*p64v3_pbslot(pb, b, 1) |= p64v3_mask(b, 1);
 l_1:	*p64v3_pbslot(pb, b, 0) |= p64v3_mask(b, 0);
 }
 
-struct bmap_interface bmap_p64v3jump = { p64v3_alloc, free, p64v3jump_set, p64v3_isset, p64v3r_first_set };
+struct bmap_interface BMAP_IFACE(p64v3jump) = {
+	p64v3_alloc, free, p64v3jump_set, p64v3_isset, FS(p64v3r_first_set),
+	.mem_usage = p64v3_mem_usage,
+};
+
+/*
+ * first_set specialized for the number of levels.
+ *
+ * Climb from level 0 until a word has a bit at or after b, then go
+ * straight down taking the lowest bit of each word. When we climb, b
+ * moves to the start of the next slot, so the bit we find above is
+ * always at or after b and on the way down there's nothing to mask.
+ * p64v3u_first_set_levels is instantiated for 1 to 6 levels with the
+ * loops unrolled and the right one is picked at alloc.
+ */
+struct p64v3u_bmap {
+	unsigned int (*first_set)(struct p64v3_bmap *, unsigned int);
+	struct p64v3_bmap pb;
+};
+
+static inline __attribute__((always_inline)) unsigned int
+p64v3u_first_set_levels(struct p64v3_bmap *pb, uint64_t b, const int levels)
+{
+	uint64_t slot = 0, w = 0;
+	int l;
+
+	if (b > pb->sz)
+		return BMAP_INVALID_OFF;
+
+#pragma GCC unroll 6
+	for (l = 0; l < levels; l++) {
+		slot = p64v3_slot(b, l);
+		w = pb->lvl[l][slot] & ~(p64v3_mask(b, l) - 1);
+		FS_WORD(l);
+		if (w)
+			break;
+		if (l == levels - 1)
+			return BMAP_INVALID_OFF;
+		b = (slot + 1) << p64v3_bps(l);
+		if (b > pb->sz)
+			return BMAP_INVALID_OFF;
+		FS_CLIMB();
+	}
+	slot = (slot << log2_64) + __builtin_ctzll(w);
+#pragma GCC unroll 6
+	for (l--; l >= 0; l--) {
+		FS_DESCEND();
+		FS_WORD(l);
+		slot = (slot << log2_64) + __builtin_ctzll(pb->lvl[l][slot]);
+	}
+	return slot;
+}
+
+#define P64V3U(n) \
+static unsigned int \
+p64v3u_first_set_##n(struct p64v3_bmap *pb, unsigned int b) \
+{ \
+	return p64v3u_first_set_levels(pb, b, n); \
+}
+
+P64V3U(1)
+P64V3U(2)
+P64V3U(3)
+P64V3U(4)
+P64V3U(5)
+P64V3U(6)
+
+static unsigned int (* const p64v3u_first_sets[P64V3_MAXLEVELS])(struct p64v3_bmap *, unsigned int) = {
+	p64v3u_first_set_1,
+	p64v3u_first_set_2,
+	p64v3u_first_set_3,
+	p64v3u_first_set_4,
+	p64v3u_first_set_5,
+	p64v3u_first_set_6,
+};
+
+static void *
+p64v3u_alloc(size_t nbits)
+{
+	struct p64v3u_bmap *pu = p64v3_alloc_off(nbits, offsetof(struct p64v3u_bmap, pb));
+
+	pu->first_set = p64v3u_first_sets[pu->pb.levels - 1];
+	return pu;
+}
+
+static void
+p64v3u_set(void *v, unsigned int b)
+{
+	struct p64v3u_bmap *pu = v;
+
+	bmap_p64v3switch_set(&pu->pb, b);
+}
+
+static bool
+p64v3u_isset(void *v, unsigned int b)
+{
+	struct p64v3u_bmap *pu = v;
+
+	return p64v3_isset(&pu->pb, b);
+}
+
+static unsigned int
+p64v3u_first_set(void *v, unsigned int b)
+{
+	struct p64v3u_bmap *pu = v;
+
+	return pu->first_set(&pu->pb, b);
+}
+
+FS_INSTRUMENT(p64v3u_first_set)
+
+static void
+p64v3u_mem_usage(void *v, struct bmap_mem_usage *mu)
+{
+	struct p64v3u_bmap *pu = v;
+
+	memset(mu, 0, sizeof(*mu));
+	mem_add(mu, pu, p64v3_alloc_size(pu->pb.sz, offsetof(struct p64v3u_bmap, pb)));
+}
+
+struct bmap_interface BMAP_IFACE(p64v3u) = {
+	p64v3u_alloc, free, p64v3u_set, p64v3u_isset, FS(p64v3u_first_set),
+	.mem_usage = p64v3u_mem_usage,
+};
+
+/*
+ * p64v3 for one writer and any number of readers without locks.
+ *
+ * The writer publishes the bitmap word first and then the summaries
+ * bottom up, all with release stores. The readers use acquire loads,
+ * so a reader that sees a summary bit also sees the words under it.
+ * A reader can see a bitmap bit before its summary bit, in which case
+ * it might not find that bit, which is fine since the set hasn't
+ * finished yet. Since bits are never cleared we can stop at the first
+ * level where the bit is already set, everything above it was
+ * published by an earlier set.
+ *
+ * p64v3c readers live with this: first_set returns bits that are
+ * set, finds everything that was set before it was called, but may
+ * or may not find any mix of bits that are being set at the same
+ * time. p64v3cs readers validate against a sequence count that the
+ * writer makes odd while it's updating and retry until they got a
+ * result from a stable bitmap, so the result is consistent with the
+ * bitmap between two sets. Neither kind of reader ever takes a lock
+ * or blocks the writer.
+ */
+struct p64v3c_bmap {
+	unsigned int seq;
+	struct p64v3_bmap pb;
+};
+
+static void *
+p64v3c_alloc(size_t nbits)
+{
+	return p64v3_alloc_off(nbits, offsetof(struct p64v3c_bmap, pb));
+}
+
+static void
+p64v3c_publish(struct p64v3_bmap *pb, unsigned int b)
+{
+	int l;
+
+	for (l = 0; l < pb->levels; l++) {
+		uint64_t *w = p64v3_pbslot(pb, b, l);
+		uint64_t m = p64v3_mask(b, l);
+		uint64_t o = __atomic_load_n(w, __ATOMIC_RELAXED);
+
+		if (o & m)
+			break;
+		__atomic_store_n(w, o | m, __ATOMIC_RELEASE);
+	}
+}
+
+static void
+p64v3c_set(void *v, unsigned int b)
+{
+	struct p64v3c_bmap *cb = v;
+
+	p64v3c_publish(&cb->pb, b);
+}
+
+static bool
+p64v3c_isset(void *v, unsigned int b)
+{
+	struct p64v3c_bmap *cb = v;
+	return (__atomic_load_n(p64v3_pbslot(&cb->pb, b, 0), __ATOMIC_ACQUIRE) & p64v3_mask(b, 0)) != 0;
+}
+
+static unsigned int
+p64v3c_first_set_r(struct p64v3_bmap *pb, uint64_t b, uint64_t l)
+{
+	uint64_t slot = p64v3_slot(b, l);
+	uint64_t masked = ~(p64v3_mask(b, l) - 1) & __atomic_load_n(&pb->lvl[l][slot], __ATOMIC_ACQUIRE);
+	if (masked) {
+		uint64_t m = ((slot << log2_64) + __builtin_ffsll(masked) - 1) << p64v3_bpb(l);
+		if (l == 0)
+			return m;
+		if (m > b)
+			b = m;
+		return p64v3c_first_set_r(pb, b, l - 1);
+	} else {
+		if (l == pb->levels - 1)
+			return BMAP_INVALID_OFF;
+		b = (slot + 1) << p64v3_bps(l);
+		if (b > pb->sz)
+			return BMAP_INVALID_OFF;
+		return p64v3c_first_set_r(pb, b, l + 1);
+	}
+}
+
+static unsigned int
+p64v3c_first_set(void *v, unsigned int b)
+{
+	struct p64v3c_bmap *cb = v;
+	if (b > cb->pb.sz)
+		return BMAP_INVALID_OFF;
+	return p64v3c_first_set_r(&cb->pb, b, 0);
+}
+
+static void
+p64v3c_mem_usage(void *v, struct bmap_mem_usage *mu)
+{
+	struct p64v3c_bmap *cb = v;
+
+	memset(mu, 0, sizeof(*mu));
+	mem_add(mu, cb, p64v3_alloc_size(cb->pb.sz, offsetof(struct p64v3c_bmap, pb)));
+}
+
+struct bmap_interface BMAP_IFACE(p64v3c) = {
+	p64v3c_alloc, free, p64v3c_set, p64v3c_isset, p64v3c_first_set,
+	.mem_usage = p64v3c_mem_usage,
+};
+
+static void
+p64v3cs_set(void *v, unsigned int b)
+{
+	struct p64v3c_bmap *cb = v;
+	unsigned int seq = cb->seq;
+
+	/* Don't make the readers retry for nothing. */
+	if (__atomic_load_n(p64v3_pbslot(&cb->pb, b, 0), __ATOMIC_RELAXED) & p64v3_mask(b, 0))
+		return;
+	__atomic_store_n(&cb->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	p64v3c_publish(&cb->pb, b);
+	__atomic_store_n(&cb->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+static unsigned int
+p64v3cs_first_set(void *v, unsigned int b)
+{
+	struct p64v3c_bmap *cb = v;
+	unsigned int seq, r;
+
+	if (b > cb->pb.sz)
+		return BMAP_INVALID_OFF;
+	do {
+		while ((seq = __atomic_load_n(&cb->seq, __ATOMIC_ACQUIRE)) & 1)
+			;
+		r = p64v3c_first_set_r(&cb->pb, b, 0);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while (__atomic_load_n(&cb->seq, __ATOMIC_RELAXED) != seq);
+	return r;
+}
+
+struct bmap_interface BMAP_IFACE(p64v3cs) = {
+	p64v3c_alloc, free, p64v3cs_set, p64v3c_isset, p64v3cs_first_set,
+	.mem_usage = p64v3c_mem_usage,
+};
+
+/*
+ * p64v3 with a cache conscious layout.
+ *
+ * p64v3_alloc puts the levels one after another from the bitmap up
+ * in one unaligned block, which means that the tiny top levels end
+ * up wherever the end of the bitmap happens to be and straddle cache
+ * lines at random. p64v3a aligns everything to cache lines: the
+ * header gets its own line, the levels are laid out from the top
+ * down, the small top levels are packed together into one hot line
+ * and every level that doesn't fit into the current line starts on
+ * a new one. Since the struct is the same as p64v3 we can use all
+ * the p64v3 functions except alloc.
+ */
+#define CACHELINE 64
+
+static inline size_t
+cacheline_roundup(size_t sz)
+{
+	return (sz + CACHELINE - 1) & ~(size_t)(CACHELINE - 1);
+}
+
+/*
+ * Lay out levels [levels - 1, low] top down starting at offset sz,
+ * packing a level into the current cache line if it fits. Returns
+ * the offset after the last level.
+ */
+static size_t
+p64v3a_layout(size_t nbits, int levels, int low, size_t sz, size_t *off)
+{
+	int l;
+
+	for (l = levels - 1; l >= low; l--) {
+		size_t lsz = p64v3_slots_per_level(nbits, l) * sizeof(uint64_t);
+
+		if ((sz % CACHELINE) + lsz > CACHELINE)
+			sz = cacheline_roundup(sz);
+		off[l] = sz;
+		sz += lsz;
+	}
+	return sz;
+}
+
+/* Size of the whole p64v3a allocation, with the level offsets in off. */
+static size_t
+p64v3a_alloc_size(size_t nbits, size_t *off)
+{
+	int levels = p64v3_levels(nbits);
+	size_t sz;
+
+	sz = cacheline_roundup(sizeof(struct p64v3_bmap) + levels * sizeof(uint64_t *));
+	return cacheline_roundup(p64v3a_layout(nbits, levels, 0, sz, off));
+}
+
+static void *
+p64v3a_alloc(size_t nbits)
+{
+	struct p64v3_bmap *pb;
+	size_t off[P64V3_MAXLEVELS];
+	size_t sz;
+	int levels;
+	int l;
+
+	levels = p64v3_levels(nbits);
+	sz = p64v3a_alloc_size(nbits, off);
+	if (posix_memalign((void **)&pb, CACHELINE, sz))
+		return NULL;
+	memset(pb, 0, sz);
+	for (l = 0; l < levels; l++)
+		pb->lvl[l] = (uint64_t *)((char *)pb + off[l]);
+	pb->sz = nbits;
+	pb->levels = levels;
+	return pb;
+}
+
+static void
+p64v3a_mem_usage(void *v, struct bmap_mem_usage *mu)
+{
+	struct p64v3_bmap *pb = v;
+	size_t off[P64V3_MAXLEVELS];
+
+	memset(mu, 0, sizeof(*mu));
+	mem_add_touched(mu, p64v3a_alloc_size(pb->sz, off));
+}
+
+struct bmap_interface BMAP_IFACE(p64v3a) = {
+	p64v3a_alloc, free, p64v3switch_set, p64v3_isset, FS(p64v3r_first_set),
+	.mem_usage = p64v3a_mem_usage,
+};
+
+/*
+ * p64v3a with B-tree style blocking of the two lowest levels.
+ *
+ * Level 0 and 1 are interleaved in groups: one cache line of 8
+ * level 1 words followed by the 512 level 0 words (4kB) they
+ * cover. A descent from level 1 to level 0 then lands right
+ * after the summary it just read instead of megabytes away. The
+ * levels above are laid out like p64v3a. lvl[0] points to the
+ * first group, lvl[1] is unused.
+ */
+#define P64V3B_L1 8			/* level 1 words per group */
+#define P64V3B_L0 (P64V3B_L1 * 64)	/* level 0 words per group */
+#define P64V3B_GROUP (P64V3B_L1 + P64V3B_L0)
+
+static inline uint64_t *
+p64v3b_pbslot(struct p64v3_bmap *pb, uint64_t b, uint64_t l)
+{
+	uint64_t slot = p64v3_slot(b, l);
+
+	switch (l) {
+	case 0:
+		return &pb->lvl[0][(slot / P64V3B_L0) * P64V3B_GROUP + P64V3B_L1 + slot % P64V3B_L0];
+	case 1:
+		return &pb->lvl[0][(slot / P64V3B_L1) * P64V3B_GROUP + slot % P64V3B_L1];
+	default:
+		return &pb->lvl[l][slot];
+	}
+}
+
+/* Size of the whole p64v3b allocation, with the level offsets in off. */
+static size_t
+p64v3b_alloc_size(size_t nbits, size_t *off)
+{
+	int levels = p64v3_levels(nbits);
+	size_t groups, g1;
+	size_t sz;
+
+	groups = (p64v3_slots_per_level(nbits, 0) + P64V3B_L0 - 1) / P64V3B_L0;
+	g1 = (p64v3_slots_per_level(nbits, 1) + P64V3B_L1 - 1) / P64V3B_L1;
+	if (g1 > groups)
+		groups = g1;
+
+	sz = cacheline_roundup(sizeof(struct p64v3_bmap) + levels * sizeof(uint64_t *));
+	sz = cacheline_roundup(p64v3a_layout(nbits, levels, 2, sz, off));
+	off[0] = off[1] = sz;
+	return sz + groups * P64V3B_GROUP * sizeof(uint64_t);
+}
+
+static void *
+p64v3b_alloc(size_t nbits)
+{
+	struct p64v3_bmap *pb;
+	size_t off[P64V3_MAXLEVELS];
+	size_t sz;
+	int levels;
+	int l;
+
+	levels = p64v3_levels(nbits);
+	sz = p64v3b_alloc_size(nbits, off);
+	if (posix_memalign((void **)&pb, CACHELINE, sz))
+		return NULL;
+	memset(pb, 0, sz);
+	for (l = 0; l < levels; l++)
+		pb->lvl[l] = (uint64_t *)((char *)pb + off[l]);
+	pb->sz = nbits;
+	pb->levels = levels;
+	return pb;
+}
+
+static void
+p64v3b_set(void *v, unsigned int b)
+{
+	struct p64v3_bmap *pb = v;
+	int l;
+
+	for (l = 0; l < pb->levels; l++) {
+		*p64v3b_pbslot(pb, b, l) |= p64v3_mask(b, l);
+	}
+}
+
+static bool
+p64v3b_isset(void *v, unsigned int b)
+{
+	struct p64v3_bmap *pb = v;
+	return (*p64v3b_pbslot(pb, b, 0) & p64v3_mask(b, 0)) != 0;
+}
+
+static unsigned int
+p64v3b_first_set_r(struct p64v3_bmap *pb, uint64_t b, uint64_t l)
+{
+	uint64_t slot = p64v3_slot(b, l);
+	uint64_t masked = ~(p64v3_mask(b, l) - 1) & *p64v3b_pbslot(pb, b, l);
+	FS_WORD(l);
+	if (masked) {
+		uint64_t m = ((slot << log2_64) + __builtin_ffsll(masked) - 1) << p64v3_bpb(l);
+		if (l == 0)
+			return m;
+		if (m > b)
+			b = m;
+		FS_DESCEND();
+		return p64v3b_first_set_r(pb, b, l - 1);
+	} else {
+		if (l == pb->levels - 1)
+			return BMAP_INVALID_OFF;
+		b = (slot + 1) << p64v3_bps(l);
+		if (b > pb->sz)
+			return BMAP_INVALID_OFF;
+		FS_CLIMB();
+		return p64v3b_first_set_r(pb, b, l + 1);
+	}
+}
+
+static unsigned int
+p64v3b_first_set(void *v, unsigned int b)
+{
+	struct p64v3_bmap *pb = v;
+	if (b > pb->sz)
+		return BMAP_INVALID_OFF;
+	return p64v3b_first_set_r(pb, b, 0);
+}
+
+FS_INSTRUMENT(p64v3b_first_set)
+
+static void
+p64v3b_mem_usage(void *v, struct bmap_mem_usage *mu)
+{
+	struct p64v3_bmap *pb = v;
+	size_t off[P64V3_MAXLEVELS];
+
+	memset(mu, 0, sizeof(*mu));
+	mem_add_touched(mu, p64v3b_alloc_size(pb->sz, off));
+}
+
+struct bmap_interface BMAP_IFACE(p64v3b) = {
+	p64v3b_alloc, free, p64v3b_set, p64v3b_isset, FS(p64v3b_first_set),
+	.mem_usage = p64v3b_mem_usage,
+};
+
+
+/*
+ * p64v3 with copy on write clones.
+ *
+ * Every level is split into blocks of 512 words (4kB) that are
+ * reference counted and shared between a bitmap and its clones.
+ * Levels smaller than that are one block of the size of the level,
+ * so a write copies at most 8kB and the summaries above level 1.
+ * Each bitmap has its own directory with one pointer per block, so a
+ * clone is a copy of the directory and a reference on every block,
+ * for 25M bits that's 6kB instead of 3MB. The first write to a shared
+ * block copies it. Since set stops at the first level where the bit
+ * was already set, a write usually copies one block on level 0 and
+ * only the summary blocks above it that actually change. Blocks that
+ * were never written to all point to one static zero block.
+ *
+ * The reference counts are atomic so that clones of one base can be
+ * used and freed in different threads, but each bitmap can still
+ * only be used by one thread at a time.
+ */
+#define P64V3COW_BLKSHIFT 9
+#define P64V3COW_BLKWORDS (1 << P64V3COW_BLKSHIFT)
+#define P64V3COW_STATIC UINT_MAX	/* refs of blocks that are never freed */
+
+struct p64v3cow_blk {
+	unsigned int refs;
+	uint64_t w[];			/* p64v3cow_blkwords of the level */
+};
+
+/*
+ * Recognized by its refs and not by its address because every ISA
+ * level has its own copy. Big enough for every level.
+ */
+static struct p64v3cow_blk p64v3cow_zero = { P64V3COW_STATIC, { [P64V3COW_BLKWORDS - 1] = 0 } };
+
+struct p64v3cow_bmap {
+	unsigned int sz;
+	unsigned int levels;
+	unsigned int nblks;
+	struct p64v3cow_blk **lvl[P64V3_MAXLEVELS];
+	struct p64v3cow_blk *blks[];
+};
+
+static inline uint64_t
+p64v3cow_blks_per_level(uint64_t nbits, uint64_t l)
+{
+	return (p64v3_slots_per_level(nbits, l) + P64V3COW_BLKWORDS - 1) >> P64V3COW_BLKSHIFT;
+}
+
+/* Words in every block of the level. */
+static inline uint64_t
+p64v3cow_blkwords(uint64_t nbits, uint64_t l)
+{
+	uint64_t n = p64v3_slots_per_level(nbits, l);
+
+	return n < P64V3COW_BLKWORDS ? n : P64V3COW_BLKWORDS;
+}
+
+static inline void
+p64v3cow_ref(struct p64v3cow_blk *blk)
+{
+	if (blk->refs != P64V3COW_STATIC)
+		__atomic_fetch_add(&blk->refs, 1, __ATOMIC_RELAXED);
+}
+
+static inline void
+p64v3cow_unref(struct p64v3cow_blk *blk)
+{
+	if (blk->refs != P64V3COW_STATIC && __atomic_sub_fetch(&blk->refs, 1, __ATOMIC_ACQ_REL) == 0)
+		free(blk);
+}
+
+static inline uint64_t
+p64v3cow_word(struct p64v3cow_bmap *pc, uint64_t slot, uint64_t l)
+{
+	return pc->lvl[l][slot >> P64V3COW_BLKSHIFT]->w[slot & (P64V3COW_BLKWORDS - 1)];
+}
+
+/* Slot we can write to, copies the block if it's shared. */
+static inline uint64_t *
+p64v3cow_wslot(struct p64v3cow_bmap *pc, uint64_t slot, uint64_t l)
+{
+	struct p64v3cow_blk **bp = &pc->lvl[l][slot >> P64V3COW_BLKSHIFT];
+
+	if (__atomic_load_n(&(*bp)->refs, __ATOMIC_ACQUIRE) != 1) {
+		size_t nw = p64v3cow_blkwords(pc->sz, l);
+		struct p64v3cow_blk *blk = malloc(sizeof(*blk) + nw * sizeof(blk->w[0]));
+
+		blk->refs = 1;
+		memcpy(blk->w, (*bp)->w, nw * sizeof(blk->w[0]));
+		p64v3cow_unref(*bp);
+		*bp = blk;
+	}
+	return &(*bp)->w[slot & (P64V3COW_BLKWORDS - 1)];
+}
+
+static void *
+p64v3cow_alloc(size_t nbits)
+{
+	struct p64v3cow_bmap *pc;
+	int levels = p64v3_levels(nbits);
+	unsigned int nblks = 0, i;
+	int l;
+
+	for (l = 0; l < levels; l++)
+		nblks += p64v3cow_blks_per_level(nbits, l);
+	pc = malloc(sizeof(*pc) + nblks * sizeof(pc->blks[0]));
+	pc->sz = nbits;
+	pc->levels = levels;
+	pc->nblks = nblks;
+	for (i = 0, l = 0; l < levels; l++) {
+		pc->lvl[l] = &pc->blks[i];
+		i += p64v3cow_blks_per_level(nbits, l);
+	}
+	for (i = 0; i < nblks; i++)
+		pc->blks[i] = &p64v3cow_zero;
+	return pc;
+}
+
+static void
+p64v3cow_free(void *v)
+{
+	struct p64v3cow_bmap *pc = v;
+	unsigned int i;
+
+	for (i = 0; i < pc->nblks; i++)
+		p64v3cow_unref(pc->blks[i]);
+	free(pc);
+}
+
+static void *
+p64v3cow_clone(void *v)
+{
+	struct p64v3cow_bmap *pc = v;
+	size_t sz = sizeof(*pc) + pc->nblks * sizeof(pc->blks[0]);
+	struct p64v3cow_bmap *c = malloc(sz);
+	unsigned int i;
+	int l;
+
+	memcpy(c, pc, sz);
+	for (l = 0; l < pc->levels; l++)
+		c->lvl[l] = c->blks + (pc->lvl[l] - pc->blks);
+	for (i = 0; i < pc->nblks; i++)
+		p64v3cow_ref(pc->blks[i]);
+	return c;
+}
+
+static void
+p64v3cow_set(void *v, unsigned int b)
+{
+	struct p64v3cow_bmap *pc = v;
+	int l;
+
+	for (l = 0; l < pc->levels; l++) {
+		uint64_t slot = p64v3_slot(b, l);
+		uint64_t m = p64v3_mask(b, l);
+
+		/* Everything above is already set, don't copy it. */
+		if (p64v3cow_word(pc, slot, l) & m)
+			break;
+		*p64v3cow_wslot(pc, slot, l) |= m;
+	}
+}
+
+static bool
+p64v3cow_isset(void *v, unsigned int b)
+{
+	struct p64v3cow_bmap *pc = v;
+	return (p64v3cow_word(pc, p64v3_slot(b, 0), 0) & p64v3_mask(b, 0)) != 0;
+}
+
+static unsigned int
+p64v3cow_first_set_r(struct p64v3cow_bmap *pc, uint64_t b, uint64_t l)
+{
+	uint64_t slot = p64v3_slot(b, l);
+	uint64_t masked = ~(p64v3_mask(b, l) - 1) & p64v3cow_word(pc, slot, l);
+	FS_WORD(l);
+	if (masked) {
+		uint64_t m = ((slot << log2_64) + __builtin_ffsll(masked) - 1) << p64v3_bpb(l);
+		if (l == 0)
+			return m;
+		if (m > b)
+			b = m;
+		FS_DESCEND();
+		return p64v3cow_first_set_r(pc, b, l - 1);
+	} else {
+		if (l == pc->levels - 1)
+			return BMAP_INVALID_OFF;
+		b = (slot + 1) << p64v3_bps(l);
+		if (b > pc->sz)
+			return BMAP_INVALID_OFF;
+		FS_CLIMB();
+		return p64v3cow_first_set_r(pc, b, l + 1);
+	}
+}
+
+static unsigned int
+p64v3cow_first_set(void *v, unsigned int b)
+{
+	struct p64v3cow_bmap *pc = v;
+	uint64_t slot, masked;
+
+	if (b > pc->sz)
+		return BMAP_INVALID_OFF;
+
+	/* Same peek as p64v3, saves the block lookups on dense maps. */
+	slot = p64v3_slot(b, 0);
+	masked = ~(p64v3_mask(b, 0) - 1) & p64v3cow_word(pc, slot, 0);
+	if (masked) {
+		FS_WORD(0);
+		return (slot << log2_64) + __builtin_ffsll(masked) - 1;
+	}
+	return p64v3cow_first_set_r(pc, b, 0);
+}
+
+FS_INSTRUMENT(p64v3cow_first_set)
+
+/*
+ * Blocks shared with clones are counted in full by every bitmap
+ * that has them, the zero block isn't counted at all.
+ */
+static void
+p64v3cow_mem_usage(void *v, struct bmap_mem_usage *mu)
+{
+	struct p64v3cow_bmap *pc = v;
+	unsigned int i;
+	int l;
+
+	memset(mu, 0, sizeof(*mu));
+	mem_add(mu, pc, sizeof(*pc) + pc->nblks * sizeof(pc->blks[0]));
+	for (l = 0; l < pc->levels; l++)
+		for (i = 0; i < p64v3cow_blks_per_level(pc->sz, l); i++)
+			if (pc->lvl[l][i]->refs != P64V3COW_STATIC)
+				mem_add_touched(mu, sizeof(struct p64v3cow_blk) +
+				    p64v3cow_blkwords(pc->sz, l) * sizeof(uint64_t));
+}
+
+struct bmap_interface BMAP_IFACE(p64v3cow) = {
+	p64v3cow_alloc, p64v3cow_free, p64v3cow_set, p64v3cow_isset, FS(p64v3cow_first_set),
+	.clone = p64v3cow_clone,
+	.mem_usage = p64v3cow_mem_usage,
+};
+
+/*
+ * p64v3 that grows.
+ *
+ * Every level is its own allocation with room for cap words. A set
+ * past the end grows the bitmap to at least twice the size, each
+ * level is extended with realloc and the new words zeroed, the
+ * existing words stay as they are. When the new size needs more than
+ * the one word on the top level, new levels are added on top with
+ * the first bit set if the old top level wasn't empty.
+ *
+ * Everything else is plain p64v3 on the struct p64v3_bmap at the end.
+ */
+struct p64v3g_bmap {
+	uint64_t cap[P64V3_MAXLEVELS];		/* words allocated per level */
+	struct p64v3_bmap pb;
+};
+
+static void
+p64v3g_grow(struct p64v3g_bmap *pg, uint64_t nbits)
+{
+	struct p64v3_bmap *pb = &pg->pb;
+	int levels;
+	int l;
+
+	if (nbits > UINT_MAX)
+		nbits = UINT_MAX;
+	levels = p64v3_levels(nbits);
+	for (l = 0; l < levels; l++) {
+		uint64_t need = p64v3_slots_per_level(nbits, l);
+
+		if (need <= pg->cap[l])
+			continue;
+		pb->lvl[l] = realloc(pb->lvl[l], need * sizeof(uint64_t));
+		memset(&pb->lvl[l][pg->cap[l]], 0, (need - pg->cap[l]) * sizeof(uint64_t));
+		if (l >= pb->levels && l > 0 && pb->lvl[l - 1][0])
+			pb->lvl[l][0] = 1;
+		pg->cap[l] = need;
+	}
+	pb->levels = levels;
+	pb->sz = nbits;
+}
+
+static void *
+p64v3g_alloc(size_t nbits)
+{
+	struct p64v3g_bmap *pg = calloc(1, sizeof(*pg) + P64V3_MAXLEVELS * sizeof(uint64_t *));
+
+	p64v3g_grow(pg, nbits);
+	return pg;
+}
+
+static void
+p64v3g_free(void *v)
+{
+	struct p64v3g_bmap *pg = v;
+	int l;
+
+	for (l = 0; l < pg->pb.levels; l++)
+		free(pg->pb.lvl[l]);
+	free(pg);
+}
+
+static void
+p64v3g_set(void *v, unsigned int b)
+{
+	struct p64v3g_bmap *pg = v;
+
+	if (b >= pg->pb.sz)
+		p64v3g_grow(pg, 2 * (uint64_t)pg->pb.sz > b + 1ULL ? 2 * (uint64_t)pg->pb.sz : b + 1ULL);
+	p64v3_set(&pg->pb, b);
+}
+
+static bool
+p64v3g_isset(void *v, unsigned int b)
+{
+	struct p64v3g_bmap *pg = v;
+
+	return b < pg->pb.sz && p64v3_isset(&pg->pb, b);
+}
+
+static unsigned int
+p64v3g_first_set(void *v, unsigned int b)
+{
+	struct p64v3g_bmap *pg = v;
+
+	return p64v3r_first_set(&pg->pb, b);
+}
+
+FS_INSTRUMENT(p64v3g_first_set)
+
+static void
+p64v3g_mem_usage(void *v, struct bmap_mem_usage *mu)
+{
+	struct p64v3g_bmap *pg = v;
+	int l;
+
+	memset(mu, 0, sizeof(*mu));
+	mem_add(mu, pg, sizeof(*pg) + P64V3_MAXLEVELS * sizeof(uint64_t *));
+	for (l = 0; l < pg->pb.levels; l++)
+		mem_add_touched(mu, pg->cap[l] * sizeof(uint64_t));
+}
 
+struct bmap_interface BMAP_IFACE(p64v3g) = {
+	p64v3g_alloc, p64v3g_free, p64v3g_set, p64v3g_isset, FS(p64v3g_first_set),
+	.mem_usage = p64v3g_mem_usage,
+};
 
 /* Like p64, but p8 instead. */
 
@@ -655,23 +2546,31 @@ p8_pbslot(struct p8_bmap *pb, uint32_t b, uint32_t l)
 	return &pb->lvl[l][p8_slot(b, l)];
 }
 
+static size_t
+p8_alloc_size(size_t nbits, int levels)
+{
+	size_t sz;
+	int l;
+
+	sz = sizeof(struct p8_bmap);
+	for (l = 0; l < levels; l++) {
+		sz += p8_slots_per_level(nbits, l);
+	}
+	sz += levels * sizeof(uint8_t **);
+	return sz;
+}
+
 static void *
 p8_alloc(size_t nbits)
 {
 	struct p8_bmap *pb;
-	size_t sz;
 	int l;
 	int levels;
 
 	for (levels = 0; p8_slots_per_level(nbits, levels) > 1; levels++)
 		;
-	sz = sizeof(*pb);
 	levels++;
-	for (l = 0; l < levels; l++) {
-		sz += p8_slots_per_level(nbits, l);
-	}
-	sz += levels * sizeof(uint8_t **);
-	pb = calloc(sz, 1);
+	pb = calloc(p8_alloc_size(nbits, levels), 1);
 	uint8_t *a = (uint8_t *)&pb->lvl[levels];
 	for (l = 0; l < levels; l++) {
 		pb->lvl[l] = a;
@@ -705,17 +2604,22 @@ p8_first_set_r(struct p8_bmap *pb, unsigned int b, uint32_t l)
 {
 	uint32_t slot = p8_slot(b, l);
 	uint32_t masked = ~(p8_mask(b, l) - 1) & pb->lvl[l][slot];
+	FS_WORD(l);
 	if (masked) {
 		uint32_t m = ((slot << log2_8) + __builtin_ffs(masked) - 1) << p8_bpb(l);
 		if (l == 0)
 			return m;
 		if (m > b)
 			b = m;
+		FS_DESCEND();
 		return p8_first_set_r(pb, b, l - 1);
 	} else {
 		if (l == pb->levels - 1)
 			return BMAP_INVALID_OFF;
 		b = (slot + 1) << p8_bps(l);
+		if (b > pb->sz)
+			return BMAP_INVALID_OFF;
+		FS_CLIMB();
 		return p8_first_set_r(pb, b, l + 1);
 	}
 }
@@ -729,7 +2633,21 @@ p8_first_set(void *v, unsigned int b)
 	return p8_first_set_r(pb, b, 0);
 }
 
-struct bmap_interface bmap_p8 = { p8_alloc, free, p8_set, p8_isset, p8_first_set };
+FS_INSTRUMENT(p8_first_set)
+
+static void
+p8_mem_usage(void *v, struct bmap_mem_usage *mu)
+{
+	struct p8_bmap *pb = v;
+
+	memset(mu, 0, sizeof(*mu));
+	mem_add(mu, pb, p8_alloc_size(pb->sz, pb->levels));
+}
+
+struct bmap_interface BMAP_IFACE(p8) = {
+	p8_alloc, free, p8_set, p8_isset, FS(p8_first_set),
+	.mem_usage = p8_mem_usage,
+};
 
 /* Like p8, but p32 instead. */
 
@@ -780,23 +2698,31 @@ p32_pbslot(struct p32_bmap *pb, uint32_t b, uint32_t l)
 	return &pb->lvl[l][p32_slot(b, l)];
 }
 
+static size_t
+p32_alloc_size(size_t nbits, int levels)
+{
+	size_t sz;
+	int l;
+
+	sz = sizeof(struct p32_bmap);
+	for (l = 0; l < levels; l++) {
+		sz += p32_slots_per_level(nbits, l) * sizeof(uint32_t);
+	}
+	sz += levels * sizeof(uint32_t **);
+	return sz;
+}
+
 static void *
 p32_alloc(size_t nbits)
 {
 	struct p32_bmap *pb;
-	size_t sz;
 	int l;
 	int levels;
 
 	for (levels = 0; p32_slots_per_level(nbits, levels) > 1; levels++)
 		;
-	sz = sizeof(*pb);
 	levels++;
-	for (l = 0; l < levels; l++) {
-		sz += p32_slots_per_level(nbits, l) * sizeof(uint32_t);
-	}
-	sz += levels * sizeof(uint32_t **);
-	pb = calloc(sz, 1);
+	pb = calloc(p32_alloc_size(nbits, levels), 1);
 	uint32_t *a = (uint32_t *)&pb->lvl[levels];
 	for (l = 0; l < levels; l++) {
 		pb->lvl[l] = a;
@@ -830,17 +2756,22 @@ p32_first_set_r(struct p32_bmap *pb, unsigned int b, uint32_t l)
 {
 	uint32_t slot = p32_slot(b, l);
 	uint32_t masked = ~(p32_mask(b, l) - 1) & pb->lvl[l][slot];
+	FS_WORD(l);
 	if (masked) {
 		uint32_t m = ((slot << log2_32) + __builtin_ffs(masked) - 1) << p32_bpb(l);
 		if (l == 0)
 			return m;
 		if (m > b)
 			b = m;
+		FS_DESCEND();
 		return p32_first_set_r(pb, b, l - 1);
 	} else {
 		if (l == pb->levels - 1)
 			return BMAP_INVALID_OFF;
 		b = (slot + 1) << p32_bps(l);
+		if (b > pb->sz)
+			return BMAP_INVALID_OFF;
+		FS_CLIMB();
 		return p32_first_set_r(pb, b, l + 1);
 	}
 }
@@ -854,4 +2785,194 @@ p32_first_set(void *v, unsigned int b)
 	return p32_first_set_r(pb, b, 0);
 }
 
-struct bmap_interface bmap_p32 = { p32_alloc, free, p32_set, p32_isset, p32_first_set };
+FS_INSTRUMENT(p32_first_set)
+
+static void
+p32_mem_usage(void *v, struct bmap_mem_usage *mu)
+{
+	struct p32_bmap *pb = v;
+
+	memset(mu, 0, sizeof(*mu));
+	mem_add(mu, pb, p32_alloc_size(pb->sz, pb->levels));
+}
+
+struct bmap_interface BMAP_IFACE(p32) = {
+	p32_alloc, free, p32_set, p32_isset, FS(p32_first_set),
+	.mem_usage = p32_mem_usage,
+};
+
+/*
+ * Not a bitmap, a sorted array of the set elements. This is what the
+ * bitmaps are supposed to replace, so we should know what it costs.
+ *
+ * Appending in order is cheap, anything else is a binary search and
+ * memmove. first_set remembers where the last call in the thread
+ * ended, which makes walking the set cheap, and searches from there:
+ * a SIMD scan of the next ARRAY_SCAN elements and if that's not
+ * enough a galloping search (doubling the step until we overshoot,
+ * then a binary search in the last step). Backwards it's a plain
+ * binary search.
+ */
+#define ARRAY_SCAN 16
+
+struct array_bmap {
+	unsigned int sz;
+	unsigned int n;
+	unsigned int cap;
+	unsigned int *a;
+};
+
+/*
+ * Where the last first_set ended. It's per thread and not in the
+ * bitmap so that first_set doesn't write and concurrent readers are
+ * fine. Any index is correct, it's only where the search starts.
+ */
+static __thread struct {
+	const struct array_bmap *ab;
+	unsigned int last;
+} array_cursor;
+
+static void *
+array_alloc(size_t nbits)
+{
+	struct array_bmap *ab = calloc(1, sizeof(*ab));
+
+	ab->sz = nbits;
+	ab->cap = 16;
+	ab->a = malloc(ab->cap * sizeof(*ab->a));
+	return ab;
+}
+
+static void
+array_free(void *v)
+{
+	struct array_bmap *ab = v;
+
+	free(ab->a);
+	free(ab);
+}
+
+/* Index of the first element >= b in [lo, hi). */
+static inline unsigned int
+array_lower_bound(const unsigned int *a, unsigned int lo, unsigned int hi, unsigned int b)
+{
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+		if (a[mid] < b)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* Number of elements < b in a[0..ARRAY_SCAN). */
+static inline unsigned int
+array_scan(const unsigned int *a, unsigned int b)
+{
+#if defined(__AVX2__)
+	/* No unsigned compares, flip the sign bits and compare signed. */
+	__m256i sign = _mm256_set1_epi32(INT_MIN);
+	__m256i bv = _mm256_xor_si256(_mm256_set1_epi32(b), sign);
+	__m256i lo = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)a), sign);
+	__m256i hi = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(a + 8)), sign);
+	unsigned int m = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(bv, lo))) |
+	    _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(bv, hi))) << 8;
+
+	return __builtin_popcount(m);
+#elif defined(__SSE2__)
+	__m128i sign = _mm_set1_epi32(INT_MIN);
+	__m128i bv = _mm_xor_si128(_mm_set1_epi32(b), sign);
+	unsigned int i, m = 0;
+
+	for (i = 0; i < ARRAY_SCAN; i += 4) {
+		__m128i x = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(a + i)), sign);
+		m |= _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(bv, x))) << i;
+	}
+	return __builtin_popcount(m);
+#else
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SCAN && a[i] < b; i++)
+		;
+	return i;
+#endif
+}
+
+static void
+array_set(void *v, unsigned int b)
+{
+	struct array_bmap *ab = v;
+	unsigned int i;
+
+	if (ab->n && ab->a[ab->n - 1] >= b) {
+		i = array_lower_bound(ab->a, 0, ab->n, b);
+		if (ab->a[i] == b)
+			return;
+	} else {
+		i = ab->n;
+	}
+	if (ab->n == ab->cap) {
+		ab->cap *= 2;
+		ab->a = realloc(ab->a, ab->cap * sizeof(*ab->a));
+	}
+	memmove(&ab->a[i + 1], &ab->a[i], (ab->n - i) * sizeof(*ab->a));
+	ab->a[i] = b;
+	ab->n++;
+}
+
+static bool
+array_isset(void *v, unsigned int b)
+{
+	struct array_bmap *ab = v;
+	unsigned int i = array_lower_bound(ab->a, 0, ab->n, b);
+
+	return i < ab->n && ab->a[i] == b;
+}
+
+static unsigned int
+array_first_set(void *v, unsigned int b)
+{
+	struct array_bmap *ab = v;
+	unsigned int c = array_cursor.ab == ab ? array_cursor.last : 0, step;
+
+	if (b > ab->sz)
+		return BMAP_INVALID_OFF;
+	if (c > ab->n)
+		c = ab->n;
+
+	if (c > 0 && ab->a[c - 1] >= b) {
+		c = array_lower_bound(ab->a, 0, c - 1, b);
+	} else if (c < ab->n && ab->a[c] < b) {
+		/* Walking the set, the next one. */
+		if (c + 1 == ab->n || ab->a[c + 1] >= b) {
+			c++;
+		} else if (c + ARRAY_SCAN <= ab->n && ab->a[c + ARRAY_SCAN - 1] >= b) {
+			c += array_scan(&ab->a[c], b);
+		} else {
+			for (step = ARRAY_SCAN; c + step < ab->n && ab->a[c + step] < b; step *= 2)
+				c += step;
+			c = array_lower_bound(ab->a, c + 1, c + step < ab->n ? c + step : ab->n, b);
+		}
+	}
+	array_cursor.ab = ab;
+	array_cursor.last = c;
+	return c < ab->n ? ab->a[c] : BMAP_INVALID_OFF;
+}
+
+static void
+array_mem_usage(void *v, struct bmap_mem_usage *mu)
+{
+	struct array_bmap *ab = v;
+
+	/* What's past n was never written, malloc could have left anything there. */
+	memset(mu, 0, sizeof(*mu));
+	mem_add(mu, ab, sizeof(*ab));
+	mem_add(mu, ab->a, ab->n * sizeof(*ab->a));
+	mu->allocated += (ab->cap - ab->n) * sizeof(*ab->a);
+}
+
+struct bmap_interface BMAP_IFACE(array) = {
+	array_alloc, array_free, array_set, array_isset, array_first_set,
+	.mem_usage = array_mem_usage,
+};
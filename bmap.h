@@ -14,19 +14,80 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#ifndef BMAP_H
+#define BMAP_H
+
 #include <limits.h>
 #include <stdbool.h>
 
 #define BMAP_INVALID_OFF UINT_MAX
 
+struct bmap_mem_usage {
+	size_t allocated;			/* bytes allocated for the bitmap */
+	size_t resident;			/* bytes of that in memory, see mem_resident in bmap.c */
+};
+
 struct bmap_interface {
 	void *(*alloc)(size_t nbits);		/* allocate a structure enough for managing nbits of bits */
 	void (*free)(void *);			/* free */
         void (*set)(void *, unsigned int b);	/* set one bit */
         bool (*isset)(void *, unsigned int b);	/* test one bit */
 	unsigned int (*first_set)(void *, unsigned int b);	/* find first bit equal or bigger than b */
+
+	/*
+	 * Optional operations, NULL if the implementation doesn't
+	 * provide them. All ranges are [lo, hi).
+	 */
+	void (*set_range)(void *, unsigned int lo, unsigned int hi);	/* set all bits in range */
+	void (*clear_range)(void *, unsigned int lo, unsigned int hi);	/* clear all bits in range */
+	bool (*any_in_range)(void *, unsigned int lo, unsigned int hi);	/* is any bit in range set */
+	bool (*all_in_range)(void *, unsigned int lo, unsigned int hi);	/* are all bits in range set */
+	unsigned int (*count_range)(void *, unsigned int lo, unsigned int hi);	/* number of set bits in range */
+	void *(*clone)(void *);			/* new bitmap with the same bits, freed with free */
+	void *(*freeze)(void *);		/* read only copy to use with bmap_ef */
+	void (*mem_usage)(void *, struct bmap_mem_usage *);	/* how much memory the bitmap uses */
+	void *(*union_many)(void **, size_t n);	/* new bitmap with the union of n bitmaps of the same size, NULL if n is 0 */
+	void (*set_batch)(void *, const unsigned int *b, size_t n);	/* set n bits in any order */
+	bool (*next_run)(void *, unsigned int b, unsigned int *start, unsigned int *end);	/* first set bit >= b and the end of its run, false if none */
+};
+
+/*
+ * The implementations are compiled for several ISA levels and the
+ * best one the cpu supports is picked at startup, or the one named in
+ * the BMAP_ISA environment variable.
+ */
+const char *bmap_isa(void);			/* name of the ISA level in use */
+int bmap_isa_select(const char *name);		/* switch ISA level, -1 if unknown or unsupported */
+
+/*
+ * bmap_auto picks one of the other implementations for every alloc
+ * from a calibration run on first use, see bmap_auto.c.
+ */
+extern struct bmap_interface bmap_auto;
+void *bmap_auto_alloc_hint(size_t nbits, double density);	/* alloc for bmap_auto, density < 0 is unknown */
+const char *bmap_auto_choice(void *v);			/* implementation picked for a bitmap */
+const char *bmap_auto_candidate(int i);			/* name of candidate i, NULL after the last */
+void bmap_auto_calibrate(void);				/* calibrate again */
+
+#ifdef BMAP_INSTRUMENT
+/*
+ * What first_set did in the pyramid implementations, collected when
+ * built with -DBMAP_INSTRUMENT. Histograms of per call counts, the
+ * last bucket collects everything bigger.
+ */
+#define BMAP_FS_HIST 16
+struct bmap_fs_stats {
+	unsigned long long calls;
+	unsigned long long peek_hits;			/* answered by the first level 0 word */
+	unsigned long long depth[BMAP_FS_HIST];		/* levels visited */
+	unsigned long long climbs[BMAP_FS_HIST];	/* steps up (l += 2 / l + 1) */
+	unsigned long long descents[BMAP_FS_HIST];	/* steps down */
+	unsigned long long words[BMAP_FS_HIST];		/* words read */
 };
 
+extern struct bmap_fs_stats bmap_fs_stats;
+#endif
+
 extern struct bmap_interface bmap_dumb;
 extern struct bmap_interface bmap_simple;
 extern struct bmap_interface bmap_p64;
@@ -40,3 +101,14 @@ extern struct bmap_interface bmap_p8;
 extern struct bmap_interface bmap_p32;
 extern struct bmap_interface bmap_p64v3switch;
 extern struct bmap_interface bmap_p64v3jump;
+extern struct bmap_interface bmap_p64v3a;
+extern struct bmap_interface bmap_p64v3b;
+extern struct bmap_interface bmap_p64v3c;
+extern struct bmap_interface bmap_p64v3cs;
+extern struct bmap_interface bmap_p64v3cow;
+extern struct bmap_interface bmap_ef;
+extern struct bmap_interface bmap_array;
+extern struct bmap_interface bmap_p64v3g;
+extern struct bmap_interface bmap_p64v3u;
+
+#endif /* BMAP_H */
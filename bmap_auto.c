@@ -0,0 +1,358 @@
+/*
+ * Copyright (c) 2015 Artur Grabowski <art@blahonga.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * An interface that picks the implementation for every alloc.
+ *
+ * The first alloc runs a short calibration: a few synthetic sets of
+ * small, mid and large sizes with sparse, mid and dense elements are
+ * populated, walked and probed with every candidate and the fastest
+ * one for each size and density is remembered. Without a density hint
+ * alloc picks the candidate that is the least slower than the best one
+ * at its worst density for the size. The bitmaps are a handle that
+ * forwards every call to the chosen implementation.
+ *
+ * If BMAP_AUTO_CACHE names a file, the calibration is read from there
+ * and written there if it wasn't or was for a different ISA level.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <err.h>
+#include <pthread.h>
+
+#include "bmap.h"
+
+static const struct {
+	const char *name;
+	struct bmap_interface *bi;
+} candidates[] = {
+	{ "simple", &bmap_simple },
+	{ "p64v3", &bmap_p64v3 },
+	{ "p64v3r", &bmap_p64v3r },
+	{ "p64v3r3", &bmap_p64v3r3 },
+	{ "p64v3u", &bmap_p64v3u },
+	{ "p8", &bmap_p8 },
+	{ "p32", &bmap_p32 },
+};
+#define NCANDIDATES (sizeof(candidates) / sizeof(candidates[0]))
+
+/* Size classes, by the upper limit of bits and the size we calibrate with. */
+static const struct {
+	size_t max;
+	unsigned int calsz;
+} sizes[] = {
+	{ 1 << 16, 4096 },
+	{ 1 << 22, 1000000 },
+	{ UINT_MAX, 5000000 },
+};
+#define NSIZES (sizeof(sizes) / sizeof(sizes[0]))
+
+/* Density classes, by upper limit and the density we calibrate with. */
+static const struct {
+	double max;
+	double caldens;
+} densities[] = {
+	{ 0.001, 0.0001 },
+	{ 0.05, 0.01 },
+	{ 1.0, 0.2 },
+};
+#define NDENSITIES (sizeof(densities) / sizeof(densities[0]))
+
+#define CAL_PROBES 200
+#define CAL_REPS 3
+#define CAL_BIG 100000		/* sets with more elements run once */
+
+static struct {
+	pthread_once_t once;
+	pthread_mutex_t mtx;
+	bool valid;			/* calibrated or read from the cache */
+	double ns[NSIZES][NDENSITIES][NCANDIDATES];
+	int choice[NSIZES][NDENSITIES + 1];	/* last is no hint */
+} cal = { PTHREAD_ONCE_INIT, PTHREAD_MUTEX_INITIALIZER };
+
+struct auto_bmap {
+	struct bmap_interface *bi;
+	const char *name;
+	void *v;
+};
+
+static double
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000.0 + ts.tv_nsec;
+}
+
+/*
+ * Populate, walk and probe one synthetic set, the best of CAL_REPS
+ * runs. Big sets take long enough to not need the repetitions.
+ */
+static double
+calibrate_one(struct bmap_interface *bi, unsigned int sz, const unsigned int *elems, unsigned int n, const unsigned int *probes)
+{
+	double best = 0;
+	int rep, reps = n > CAL_BIG ? 1 : CAL_REPS;
+
+	for (rep = 0; rep < reps; rep++) {
+		volatile unsigned int sink = 0;
+		double start = now_ns(), t;
+		void *v = bi->alloc(sz);
+		unsigned int i, b;
+
+		for (i = 0; i < n; i++)
+			bi->set(v, elems[i]);
+		for (b = bi->first_set(v, 0); b != BMAP_INVALID_OFF; b = bi->first_set(v, b + 1))
+			sink++;
+		for (i = 0; i < CAL_PROBES; i++)
+			sink += bi->first_set(v, probes[i]);
+		bi->free(v);
+		t = now_ns() - start;
+		if (rep == 0 || t < best)
+			best = t;
+	}
+	return best;
+}
+
+static void
+calibrate_choose(void)
+{
+	int s, d, c;
+
+	for (s = 0; s < NSIZES; s++) {
+		double worst[NCANDIDATES] = { 0 };
+
+		for (d = 0; d < NDENSITIES; d++) {
+			cal.choice[s][d] = 0;
+			for (c = 0; c < NCANDIDATES; c++)
+				if (cal.ns[s][d][c] < cal.ns[s][d][cal.choice[s][d]])
+					cal.choice[s][d] = c;
+			for (c = 0; c < NCANDIDATES; c++) {
+				double r = cal.ns[s][d][c] / cal.ns[s][d][cal.choice[s][d]];
+				if (r > worst[c])
+					worst[c] = r;
+			}
+		}
+		cal.choice[s][NDENSITIES] = 0;
+		for (c = 0; c < NCANDIDATES; c++)
+			if (worst[c] < worst[cal.choice[s][NDENSITIES]])
+				cal.choice[s][NDENSITIES] = c;
+	}
+}
+
+static void
+calibrate_run(void)
+{
+	unsigned short xsubi[3] = { 4711, 0, 0x330e };
+	unsigned int probes[CAL_PROBES];
+	int s, d, c;
+	unsigned int i;
+
+	for (s = 0; s < NSIZES; s++) {
+		unsigned int sz = sizes[s].calsz;
+
+		for (i = 0; i < CAL_PROBES; i++)
+			probes[i] = nrand48(xsubi) % sz;
+		for (d = 0; d < NDENSITIES; d++) {
+			unsigned int n = sz * densities[d].caldens;
+			unsigned int *elems;
+
+			if (n < 4)
+				n = 4;
+			elems = malloc(n * sizeof(*elems));
+			for (i = 0; i < n; i++)
+				elems[i] = nrand48(xsubi) % sz;
+			for (c = 0; c < NCANDIDATES; c++)
+				cal.ns[s][d][c] = calibrate_one(candidates[c].bi, sz, elems, n, probes);
+			free(elems);
+		}
+	}
+	calibrate_choose();
+}
+
+/*
+ * The cache file is the ISA level on the first line and then one line
+ * per size and density with the time of each candidate.
+ */
+static bool
+cache_read(const char *path)
+{
+	char isa[64];
+	int s, d, c;
+	FILE *f;
+	bool ok = false;
+
+	if ((f = fopen(path, "r")) == NULL)
+		return false;
+	if (fscanf(f, "bmap_auto 2 %63s", isa) != 1 || strcmp(isa, bmap_isa()))
+		goto out;
+	for (s = 0; s < NSIZES; s++)
+		for (d = 0; d < NDENSITIES; d++)
+			for (c = 0; c < NCANDIDATES; c++)
+				if (fscanf(f, "%lf", &cal.ns[s][d][c]) != 1)
+					goto out;
+	calibrate_choose();
+	ok = true;
+out:
+	fclose(f);
+	return ok;
+}
+
+static void
+cache_write(const char *path)
+{
+	int s, d, c;
+	FILE *f;
+
+	if ((f = fopen(path, "w")) == NULL) {
+		warn("bmap_auto: %s", path);
+		return;
+	}
+	fprintf(f, "bmap_auto 2 %s\n", bmap_isa());
+	for (s = 0; s < NSIZES; s++) {
+		for (d = 0; d < NDENSITIES; d++) {
+			for (c = 0; c < NCANDIDATES; c++)
+				fprintf(f, "%s%.0f", c ? " " : "", cal.ns[s][d][c]);
+			fprintf(f, "\n");
+		}
+	}
+	fclose(f);
+}
+
+/* Nothing to do if bmap_auto_calibrate got here first. */
+static void
+calibrate_init(void)
+{
+	const char *path = getenv("BMAP_AUTO_CACHE");
+
+	pthread_mutex_lock(&cal.mtx);
+	if (!cal.valid && !(path != NULL && cache_read(path))) {
+		calibrate_run();
+		if (path != NULL)
+			cache_write(path);
+	}
+	cal.valid = true;
+	pthread_mutex_unlock(&cal.mtx);
+}
+
+void
+bmap_auto_calibrate(void)
+{
+	const char *path = getenv("BMAP_AUTO_CACHE");
+
+	pthread_mutex_lock(&cal.mtx);
+	calibrate_run();
+	if (path != NULL)
+		cache_write(path);
+	cal.valid = true;
+	pthread_mutex_unlock(&cal.mtx);
+	pthread_once(&cal.once, calibrate_init);
+}
+
+void *
+bmap_auto_alloc_hint(size_t nbits, double density)
+{
+	struct auto_bmap *ab = malloc(sizeof(*ab));
+	int s, d, c;
+
+	pthread_once(&cal.once, calibrate_init);
+	for (s = 0; s < NSIZES - 1 && nbits > sizes[s].max; s++)
+		;
+	if (density < 0)
+		d = NDENSITIES;
+	else
+		for (d = 0; d < NDENSITIES - 1 && density > densities[d].max; d++)
+			;
+	pthread_mutex_lock(&cal.mtx);
+	c = cal.choice[s][d];
+	pthread_mutex_unlock(&cal.mtx);
+	ab->bi = candidates[c].bi;
+	ab->name = candidates[c].name;
+	ab->v = ab->bi->alloc(nbits);
+	return ab;
+}
+
+const char *
+bmap_auto_choice(void *v)
+{
+	struct auto_bmap *ab = v;
+
+	return ab->name;
+}
+
+const char *
+bmap_auto_candidate(int i)
+{
+	return i < NCANDIDATES ? candidates[i].name : NULL;
+}
+
+static void *
+auto_alloc(size_t nbits)
+{
+	return bmap_auto_alloc_hint(nbits, -1);
+}
+
+static void
+auto_free(void *v)
+{
+	struct auto_bmap *ab = v;
+
+	ab->bi->free(ab->v);
+	free(ab);
+}
+
+static void
+auto_set(void *v, unsigned int b)
+{
+	struct auto_bmap *ab = v;
+
+	ab->bi->set(ab->v, b);
+}
+
+static bool
+auto_isset(void *v, unsigned int b)
+{
+	struct auto_bmap *ab = v;
+
+	return ab->bi->isset(ab->v, b);
+}
+
+static unsigned int
+auto_first_set(void *v, unsigned int b)
+{
+	struct auto_bmap *ab = v;
+
+	return ab->bi->first_set(ab->v, b);
+}
+
+static void
+auto_mem_usage(void *v, struct bmap_mem_usage *mu)
+{
+	struct auto_bmap *ab = v;
+
+	ab->bi->mem_usage(ab->v, mu);
+	mu->allocated += sizeof(*ab);
+	mu->resident += sizeof(*ab);
+}
+
+struct bmap_interface bmap_auto = {
+	auto_alloc, auto_free, auto_set, auto_isset, auto_first_set,
+	.mem_usage = auto_mem_usage,
+};
@@ -0,0 +1,171 @@
+/*
+ * Copyright (c) 2015 Artur Grabowski <art@blahonga.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * The fastest p64v3 set and search as static inline functions for
+ * loops where the call through struct bmap_interface costs too much.
+ * They work on bitmaps from bmap_p64v3, bmap_p64v3r and
+ * bmap_p64v3switch (which all have the same layout) and can be mixed
+ * freely with calls through the interfaces.
+ *
+ * This is also where the p64v3 layout and the recursive search live,
+ * bmap.c includes it and uses the short names without the bmap_
+ * prefix. Keep in mind that the inlined code is compiled with the flags of
+ * the caller and not for the ISA level picked at runtime.
+ */
+
+#ifndef BMAP_INLINE_H
+#define BMAP_INLINE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "bmap.h"
+
+#define BMAP_P64V3_LOG2 6
+
+/* 2^32 bits need 6 levels. */
+#define BMAP_P64V3_MAXLEVELS 6
+
+struct bmap_p64v3_bmap {
+	unsigned int sz;
+	unsigned int levels;
+	uint64_t *lvl[];
+};
+
+/*
+ * Hooks for counting what the search does, bmap.c defines them for
+ * the instrumented build.
+ */
+#ifndef BMAP_FS_WORD
+#define BMAP_FS_WORD(l)
+#endif
+#ifndef BMAP_FS_CLIMB
+#define BMAP_FS_CLIMB()
+#endif
+#ifndef BMAP_FS_DESCEND
+#define BMAP_FS_DESCEND()
+#endif
+
+/* log2 of how many bits one bit covers at this level. */
+static inline uint64_t
+bmap_p64v3_bpb(uint64_t l)
+{
+	return l * BMAP_P64V3_LOG2;
+}
+
+/* log2 of how many bits one slot covers at this level. */
+static inline uint64_t
+bmap_p64v3_bps(uint64_t l)
+{
+	return (l + 1) * BMAP_P64V3_LOG2;
+}
+
+static inline uint64_t
+bmap_p64v3_slot(uint64_t b, uint64_t l)
+{
+	return b >> bmap_p64v3_bps(l);
+}
+
+static inline uint64_t
+bmap_p64v3_mask(uint64_t b, uint64_t l)
+{
+	return 1LLU << ((b >> bmap_p64v3_bpb(l)) & ((1 << BMAP_P64V3_LOG2) - 1));
+}
+
+/* How many slots do we need to cover nbits on this level */
+static inline uint64_t
+bmap_p64v3_slots_per_level(uint64_t nbits, uint64_t l)
+{
+	return bmap_p64v3_slot(nbits, l) + 1;
+}
+
+static inline uint64_t *
+bmap_p64v3_pbslot(struct bmap_p64v3_bmap *pb, uint64_t b, uint64_t l)
+{
+	return &pb->lvl[l][bmap_p64v3_slot(b, l)];
+}
+
+/* How many levels do we need to cover nbits */
+static inline int
+bmap_p64v3_levels(size_t nbits)
+{
+	int levels;
+
+	for (levels = 0; bmap_p64v3_slots_per_level(nbits, levels) > 1; levels++)
+		;
+	return levels + 1;
+}
+
+/* p64v3switch set. */
+static inline void
+bmap_p64v3switch_set(void *v, unsigned int b)
+{
+	struct bmap_p64v3_bmap *pb = v;
+
+	switch (pb->levels) {
+	case 6:
+		*bmap_p64v3_pbslot(pb, b, 5) |= bmap_p64v3_mask(b, 5);
+	case 5:
+		*bmap_p64v3_pbslot(pb, b, 4) |= bmap_p64v3_mask(b, 4);
+	case 4:
+		*bmap_p64v3_pbslot(pb, b, 3) |= bmap_p64v3_mask(b, 3);
+	case 3:
+		*bmap_p64v3_pbslot(pb, b, 2) |= bmap_p64v3_mask(b, 2);
+	case 2:
+		*bmap_p64v3_pbslot(pb, b, 1) |= bmap_p64v3_mask(b, 1);
+	case 1:
+		*bmap_p64v3_pbslot(pb, b, 0) |= bmap_p64v3_mask(b, 0);
+	}
+}
+
+/* First set bit from b, starting at level l. */
+static inline unsigned int
+bmap_p64v3r_first_set_r(struct bmap_p64v3_bmap *pb, uint64_t b, uint64_t l)
+{
+	uint64_t slot = bmap_p64v3_slot(b, l);
+	uint64_t masked = ~(bmap_p64v3_mask(b, l) - 1) & pb->lvl[l][slot];
+	BMAP_FS_WORD(l);
+	if (masked) {
+		uint64_t m = ((slot << BMAP_P64V3_LOG2) + __builtin_ffsll(masked) - 1) << bmap_p64v3_bpb(l);
+		if (l == 0)
+			return m;
+		if (m > b)
+			b = m;
+		BMAP_FS_DESCEND();
+		return bmap_p64v3r_first_set_r(pb, b, l - 1);
+	} else {
+		if (l == pb->levels - 1)
+			return BMAP_INVALID_OFF;
+		b = (slot + 1) << bmap_p64v3_bps(l);
+		if (b > pb->sz)
+			return BMAP_INVALID_OFF;
+		BMAP_FS_CLIMB();
+		return bmap_p64v3r_first_set_r(pb, b, l + 1);
+	}
+}
+
+/* p64v3r first_set. */
+static inline unsigned int
+bmap_p64v3r_first_set(void *v, unsigned int b)
+{
+	struct bmap_p64v3_bmap *pb = v;
+	if (b > pb->sz)
+		return BMAP_INVALID_OFF;
+	return bmap_p64v3r_first_set_r(pb, b, 0);
+}
+
+#endif /* BMAP_INLINE_H */
@@ -0,0 +1,169 @@
+/*
+ * Copyright (c) 2015 Artur Grabowski <art@blahonga.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Runtime selection of the ISA level.
+ *
+ * bmap.c is compiled once per ISA level, each copy exporting its
+ * interfaces as bmap_<name>_<level>. This file compiles with the
+ * baseline flags and copies the best set the cpu supports into the
+ * public bmap_<name> interfaces before main runs. The BMAP_ISA
+ * environment variable or bmap_isa_select can force a level.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+
+#include "bmap.h"
+
+#ifdef BMAP_INSTRUMENT
+struct bmap_fs_stats bmap_fs_stats;
+#endif
+
+/* Every interface in bmap.c. */
+#define BMAP_IMPLS(X, isa) \
+	X(dumb, isa) \
+	X(simple, isa) \
+	X(p64, isa) \
+	X(p64_naive, isa) \
+	X(p64v2, isa) \
+	X(p64v3, isa) \
+	X(p64v3r, isa) \
+	X(p64v3r2, isa) \
+	X(p64v3r3, isa) \
+	X(p8, isa) \
+	X(p32, isa) \
+	X(p64v3switch, isa) \
+	X(p64v3jump, isa) \
+	X(p64v3a, isa) \
+	X(p64v3b, isa) \
+	X(p64v3c, isa) \
+	X(p64v3cs, isa) \
+	X(p64v3cow, isa) \
+	X(ef, isa) \
+	X(array, isa) \
+	X(p64v3g, isa) \
+	X(p64v3u, isa)
+
+#define DEFINE(n, isa) struct bmap_interface bmap_##n;
+#define DECLARE(n, isa) extern struct bmap_interface bmap_##n##_##isa;
+#define INSTALL(n, isa) bmap_##n = bmap_##n##_##isa;
+
+#define ISA_LEVEL(isa) \
+	BMAP_IMPLS(DECLARE, isa) \
+	static void \
+	install_##isa(void) \
+	{ \
+		BMAP_IMPLS(INSTALL, isa) \
+	}
+
+BMAP_IMPLS(DEFINE, none)
+
+#if defined(__x86_64__)
+ISA_LEVEL(v1)
+ISA_LEVEL(v2)
+ISA_LEVEL(v3)
+ISA_LEVEL(v4)
+
+static bool
+v2_supported(void)
+{
+	return __builtin_cpu_supports("sse3") && __builtin_cpu_supports("ssse3") &&
+	    __builtin_cpu_supports("sse4.1") && __builtin_cpu_supports("sse4.2") &&
+	    __builtin_cpu_supports("popcnt");
+}
+
+static bool
+v3_supported(void)
+{
+	return v2_supported() && __builtin_cpu_supports("avx") &&
+	    __builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi") &&
+	    __builtin_cpu_supports("bmi2") && __builtin_cpu_supports("fma");
+}
+
+static bool
+v4_supported(void)
+{
+	return v3_supported() && __builtin_cpu_supports("avx512f") &&
+	    __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512cd") &&
+	    __builtin_cpu_supports("avx512dq") && __builtin_cpu_supports("avx512vl");
+}
+
+/* Best first. */
+static const struct isa_level {
+	const char *name;
+	bool (*supported)(void);
+	void (*install)(void);
+} isa_levels[] = {
+	{ "x86-64-v4", v4_supported, install_v4 },
+	{ "x86-64-v3", v3_supported, install_v3 },
+	{ "x86-64-v2", v2_supported, install_v2 },
+	{ "x86-64", NULL, install_v1 },
+};
+#else
+ISA_LEVEL(base)
+
+static const struct isa_level {
+	const char *name;
+	bool (*supported)(void);
+	void (*install)(void);
+} isa_levels[] = {
+	{ "base", NULL, install_base },
+};
+#endif
+
+static const struct isa_level *isa_current;
+
+const char *
+bmap_isa(void)
+{
+	return isa_current->name;
+}
+
+int
+bmap_isa_select(const char *name)
+{
+	int i;
+
+	for (i = 0; i < sizeof(isa_levels) / sizeof(isa_levels[0]); i++) {
+		const struct isa_level *il = &isa_levels[i];
+
+		if (name != NULL && strcmp(name, il->name))
+			continue;
+		if (il->supported != NULL && !il->supported())
+			continue;
+		il->install();
+		isa_current = il;
+		return 0;
+	}
+	return -1;
+}
+
+__attribute__((constructor)) static void
+bmap_isa_init(void)
+{
+	const char *force = getenv("BMAP_ISA");
+
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+#endif
+	if (force != NULL && bmap_isa_select(force) == 0)
+		return;
+	if (force != NULL)
+		warnx("BMAP_ISA=%s unknown or not supported by this cpu, ignored", force);
+	bmap_isa_select(NULL);
+}
@@ -14,6 +14,10 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE		/* pthread_setaffinity_np */
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <inttypes.h>
@@ -21,10 +25,24 @@
 #include <err.h>
 #include <limits.h>
 #include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <math.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
 
 #include <stopwatch.h>
 
 #include "bmap.h"
+#include "bmap_inline.h"
+
+#define howmany(a) (sizeof(a) / sizeof(a[0]))
 
 struct {
 	struct bmap_interface *bi;
@@ -43,6 +61,29 @@ struct {
 	{ &bmap_p32, "p32" },
 	{ &bmap_p64v3switch, "p64v3switch" },
 	{ &bmap_p64v3jump, "p64v3jump" },
+	{ &bmap_p64v3a, "p64v3a" },
+	{ &bmap_p64v3b, "p64v3b" },
+	{ &bmap_p64v3c, "p64v3c" },
+	{ &bmap_p64v3cs, "p64v3cs" },
+	{ &bmap_p64v3cow, "p64v3cow" },
+	{ &bmap_array, "array" },
+	{ &bmap_p64v3g, "p64v3g" },
+	{ &bmap_p64v3u, "p64v3u" },
+	{ &bmap_auto, "auto" },
+};
+
+/*
+ * One writer and many readers. The lock free implementations are
+ * compared to p64v3r with a mutex around every call.
+ */
+struct {
+	struct bmap_interface *bi;
+	const char *n;
+	bool lock;
+} conc_tests[] = {
+	{ &bmap_p64v3c, "p64v3c", false },
+	{ &bmap_p64v3cs, "p64v3cs", false },
+	{ &bmap_p64v3r, "p64v3r-mutex", true },
 };
 
 static void
@@ -75,11 +116,303 @@ smoke_test(struct bmap_interface *bi, const char *name)
 	printf("smoke test of %s worked\n", name);
 }
 
+/*
+ * Compare the range operations against a plain array of bits
+ * through a bunch of set_range/clear_range calls that hit word
+ * boundaries, whole words and several levels.
+ */
+static void
+range_smoke_test(struct bmap_interface *bi, const char *name)
+{
+	static const struct {
+		bool set;
+		unsigned int lo, hi;
+	} ops[] = {
+		{ true, 5, 6 },
+		{ true, 60, 70 },
+		{ true, 128, 192 },
+		{ true, 1000, 200000 },
+		{ false, 1001, 1002 },
+		{ false, 4096, 8192 },
+		{ false, 4000, 4100 },
+		{ true, 299990, 300000 },
+		{ false, 100, 199999 },
+		{ true, 262143, 262145 },
+		{ false, 0, 262144 },
+		{ true, 0, 300000 },
+		{ false, 64, 299936 },
+	};
+	const unsigned int sz = 300000;
+	void *b = bi->alloc(sz);
+	char *ref = calloc(sz, 1);
+	unsigned int o, i, lo, hi;
+
+	for (o = 0; o < howmany(ops); o++) {
+		if (ops[o].set)
+			bi->set_range(b, ops[o].lo, ops[o].hi);
+		else
+			bi->clear_range(b, ops[o].lo, ops[o].hi);
+		memset(&ref[ops[o].lo], ops[o].set, ops[o].hi - ops[o].lo);
+
+		for (i = 0, lo = bi->first_set(b, 0); i < sz; i++) {
+			if (!ref[i])
+				continue;
+			if (lo != i)
+				errx(1, "range smoke test %s op %u first_set %u != %u", name, o, lo, i);
+			lo = bi->first_set(b, i + 1);
+		}
+		if (lo != BMAP_INVALID_OFF)
+			errx(1, "range smoke test %s op %u extra bit %u", name, o, lo);
+
+		for (lo = 0; lo < sz; lo += 997) {
+			bool any = false, all = true;
+
+			hi = lo + (lo % 5) * 1500 + 1;
+			if (hi > sz)
+				hi = sz;
+			for (i = lo; i < hi; i++) {
+				any |= ref[i];
+				all &= ref[i];
+			}
+			if (bi->any_in_range(b, lo, hi) != any)
+				errx(1, "range smoke test %s op %u any_in_range(%u, %u) != %d", name, o, lo, hi, any);
+			if (bi->all_in_range(b, lo, hi) != all)
+				errx(1, "range smoke test %s op %u all_in_range(%u, %u) != %d", name, o, lo, hi, all);
+		}
+	}
+	free(ref);
+	bi->free(b);
+	printf("range smoke test of %s worked\n", name);
+}
+
+/*
+ * Compare count_range against a plain array of bits on a bitmap with
+ * dense, sparse and empty areas.
+ */
+static void
+count_smoke_test(struct bmap_interface *bi, const char *name)
+{
+	const unsigned int sz = 300000;
+	void *b = bi->alloc(sz);
+	char *ref = calloc(sz, 1);
+	unsigned int i, lo, hi, n, r;
+
+	for (i = 0; i < sz; i++) {
+		unsigned int x = i * 2654435761U;
+
+		if ((i < 20000 && x % 3) || (i > 100000 && i < 150000 && x % 97 == 0) || i == sz - 1 || (i > 200000 && i < 210000)) {
+			bi->set(b, i);
+			ref[i] = 1;
+		}
+	}
+	for (lo = 0; lo < sz; lo += 1009) {
+		for (hi = lo; hi <= sz; hi += 1 + hi * 7 % 30011) {
+			for (n = 0, i = lo; i < hi; i++)
+				n += ref[i];
+			if ((r = bi->count_range(b, lo, hi)) != n)
+				errx(1, "count smoke test %s count_range(%u, %u) = %u != %u", name, lo, hi, r, n);
+		}
+	}
+	free(ref);
+	bi->free(b);
+	printf("count smoke test of %s worked\n", name);
+}
+
+/*
+ * Clones must see the bits of the original when they were cloned
+ * and neither must see what's set in the other afterwards.
+ */
+static void
+clone_smoke_test(struct bmap_interface *bi, const char *name)
+{
+	const unsigned int sz = 3000000;
+	void *a = bi->alloc(sz);
+	void *b, *c;
+	unsigned int r;
+
+	bi->set(a, 10);
+	bi->set(a, 2000000);
+	b = bi->clone(a);
+	bi->set(b, 11);
+	bi->set(b, 1000000);
+	bi->set(a, 12);
+	c = bi->clone(b);
+	bi->set(c, 2999999);
+	bi->free(b);
+	b = NULL;
+#define T(v, s, e) if ((r = bi->first_set(v, s)) != e) errx(1, "clone smoke test %s first_set(%s, %d) != %d (%d)", name, #v, s, e, r)
+	T(a, 0, 10);
+	T(a, 11, 12);
+	T(a, 13, 2000000);
+	T(a, 2000001, BMAP_INVALID_OFF);
+	T(c, 0, 10);
+	T(c, 11, 11);
+	T(c, 12, 1000000);
+	T(c, 1000001, 2000000);
+	T(c, 2000001, 2999999);
+#undef T
+	bi->free(a);
+	bi->free(c);
+	printf("clone smoke test of %s worked\n", name);
+}
+
+/*
+ * Freeze a bitmap with dense, sparse and empty areas and compare
+ * every first_set on the frozen one with the original.
+ */
+static void
+freeze_smoke_test(struct bmap_interface *bi, const char *name)
+{
+	const unsigned int sz = 300000;
+	void *b = bi->alloc(sz);
+	void *f;
+	unsigned int i, r, e;
+
+	for (i = 0; i < sz; i++) {
+		unsigned int x = i * 2654435761U;
+
+		if ((i < 20000 && x % 3) || (i > 100000 && i < 150000 && x % 97 == 0) || i == sz - 1 || (i > 200000 && i < 210000))
+			bi->set(b, i);
+	}
+	f = bi->freeze(b);
+	for (i = 0; i <= sz; i++) {
+		if ((r = bmap_ef.first_set(f, i)) != (e = bi->first_set(b, i)))
+			errx(1, "freeze smoke test %s first_set(%u) %u != %u", name, i, r, e);
+		if (i < sz && bmap_ef.isset(f, i) != bi->isset(b, i))
+			errx(1, "freeze smoke test %s isset(%u)", name, i);
+	}
+	bmap_ef.free(f);
+	bi->free(b);
+	printf("freeze smoke test of %s worked\n", name);
+}
+
+/*
+ * set_batch against one set per bit, with duplicates and the edges
+ * of the bitmap.
+ */
+static void
+batch_smoke_test(struct bmap_interface *bi, const char *name)
+{
+	const unsigned int sz = 3000000;
+	const size_t n = 100000;
+	unsigned int *ids = malloc(n * sizeof(*ids));
+	void *a = bi->alloc(sz);
+	void *b = bi->alloc(sz);
+	unsigned int i, r, e;
+
+	for (i = 0; i < n; i++)
+		ids[i] = (i * 2654435761U) % (i & 1 ? sz : sz / 100);
+	ids[0] = 0;
+	ids[1] = sz - 1;
+	for (i = 0; i < n; i++)
+		bi->set(a, ids[i]);
+	bi->set_batch(b, ids, n);
+	bi->set_batch(b, ids, 10);
+	for (i = 0; i <= sz; i = e + 1) {
+		if ((r = bi->first_set(b, i)) != (e = bi->first_set(a, i)))
+			errx(1, "batch smoke test %s first_set(%u) %u != %u", name, i, r, e);
+		if (e == BMAP_INVALID_OFF)
+			break;
+	}
+	bi->free(a);
+	bi->free(b);
+	free(ids);
+	printf("batch smoke test of %s worked\n", name);
+}
+
+/*
+ * next_run against first_set and isset from every bit, with runs
+ * inside a word, across words, of whole words and up to the end.
+ */
+static void
+run_smoke_test(struct bmap_interface *bi, const char *name)
+{
+	static const unsigned int runs[][2] = {
+		{ 3, 5 }, { 7, 8 }, { 60, 200 }, { 256, 320 }, { 384, 4096 }, { 4100, 4101 }, { 4900, 5000 },
+	};
+	const unsigned int sz = 5000;
+	void *v = bi->alloc(sz);
+	unsigned int i, b, s, e, es, ee;
+
+	for (i = 0; i < howmany(runs); i++)
+		for (b = runs[i][0]; b < runs[i][1]; b++)
+			bi->set(v, b);
+	for (b = 0; b <= sz; b++) {
+		es = bi->first_set(v, b);
+		if (!bi->next_run(v, b, &s, &e)) {
+			if (es != BMAP_INVALID_OFF)
+				errx(1, "run smoke test %s next_run(%u) found nothing, expected %u", name, b, es);
+			continue;
+		}
+		for (ee = es; ee < sz && bi->isset(v, ee); ee++)
+			;
+		if (s != es || e != ee)
+			errx(1, "run smoke test %s next_run(%u) [%u, %u) != [%u, %u)", name, b, s, e, es, ee);
+	}
+	bi->free(v);
+	printf("run smoke test of %s worked\n", name);
+}
+
+/*
+ * Grow p64v3g from nothing through all the level changes and compare
+ * it with a p64v3 that has the final size from the start.
+ */
+static void
+grow_smoke_test(void)
+{
+	const unsigned int sz = 30000000;
+	void *g = bmap_p64v3g.alloc(0);
+	void *ref = bmap_p64v3.alloc(sz);
+	unsigned int i, b, r, e;
+
+	for (i = 0, b = 0; b < sz; i++, b += 1 + i * i % 9973) {
+		if (bmap_p64v3g.isset(g, b))
+			errx(1, "grow smoke test isset(%u) before set", b);
+		bmap_p64v3g.set(g, b);
+		bmap_p64v3.set(ref, b);
+		if ((r = bmap_p64v3g.first_set(g, b / 2)) != (e = bmap_p64v3.first_set(ref, b / 2)))
+			errx(1, "grow smoke test first_set(%u) %u != %u", b / 2, r, e);
+	}
+	for (b = 0; b < sz; b = e + 1) {
+		if ((r = bmap_p64v3g.first_set(g, b)) != (e = bmap_p64v3.first_set(ref, b)))
+			errx(1, "grow smoke test first_set(%u) %u != %u", b, r, e);
+		if (e == BMAP_INVALID_OFF)
+			break;
+	}
+	bmap_p64v3g.free(g);
+	bmap_p64v3.free(ref);
+	printf("grow smoke test worked\n");
+}
+
+/*
+ * State of the element generators, each set has its own random
+ * number stream so that the sets don't change when others are added.
+ */
+struct gen_state {
+	unsigned short xsubi[3];
+	unsigned int cur;
+	unsigned int left;
+};
+
+struct test_set;
+static unsigned int gen_uniform(struct test_set *, struct gen_state *);
+static unsigned int gen_runs(struct test_set *, struct gen_state *);
+static unsigned int gen_clustered(struct test_set *, struct gen_state *);
+static unsigned int gen_zipf(struct test_set *, struct gen_state *);
+static unsigned int gen_bimodal(struct test_set *, struct gen_state *);
+
 struct test_set {
 	unsigned int nelems;		/* number of elements in this set. */
 	unsigned int bmapsz;		/* size of bmap we want to test with. */
 	const char *set_name;
+	unsigned int (*gen)(struct test_set *, struct gen_state *);	/* next element, NULL for the old uniform sets. */
+	unsigned short seed;		/* seed for gen. */
 	unsigned int *arr;		/* pregenerated array of elements we expect to find in array. */
+	unsigned int *probes;		/* random starting points for first_set. */
+	unsigned int *probe_res;	/* expected results of first_set(probes[i]). */
+	unsigned int slices[16];	/* number of elements in each 1/16th of the bitmap. */
+	unsigned int rangelen;		/* range tests, length of the ranges starting at arr[i]. */
+	unsigned int rangealign;	/* range tests, alignment of arr[i]. */
 } test_sets[] = {
 	{ 	10,		1000,		"small-sparse" },
 	{ 	100,		1000000,	"mid-sparse" },
@@ -87,9 +420,35 @@ struct test_set {
 	{ 	500000,		1000000,	"mid-dense" },
 	{	10,		10000000,	"large-sparse" },
 	{	10,		25000000,	"huge-sparse" },
+	{	100000,		10000000,	"uniform",	gen_uniform,	1 },
+	{	100000,		10000000,	"runs",		gen_runs,	2 },
+	{	100000,		10000000,	"clustered",	gen_clustered,	3 },
+	{	100000,		10000000,	"zipf",		gen_zipf,	4 },
+	{	100000,		10000000,	"bimodal",	gen_bimodal,	5 },
 };
 
-#define howmany(a) (sizeof(a) / sizeof(a[0]))
+/*
+ * nelems ranges of rangelen bits each at random offsets.
+ */
+struct test_set range_sets[] = {
+	{ .nelems = 10000, .bmapsz = 25000000, .set_name = "range-short", .rangelen = 13, .rangealign = 1 },
+	{ .nelems = 1000, .bmapsz = 25000000, .set_name = "range-aligned", .rangelen = 4096, .rangealign = 64 },
+	{ .nelems = 10, .bmapsz = 25000000, .set_name = "range-long", .rangelen = 1000000, .rangealign = 1 },
+};
+
+/*
+ * nelems random bits in random order with duplicates, for set_batch.
+ */
+struct test_set batch_sets[] = {
+	{ .nelems = 2000000, .bmapsz = 25000000, .set_name = "batch-25M" },
+	{ .nelems = 8000000, .bmapsz = 100000000, .set_name = "batch-100M" },
+};
+
+/*
+ * Number of random first_set calls per set in the probe test. Kept
+ * low because dumb needs to walk half of the huge bitmaps per probe.
+ */
+#define NPROBES 100
 
 static int
 uintcmp(const void *av, const void *bv)
@@ -103,11 +462,90 @@ uintcmp(const void *av, const void *bv)
 	return 0;
 }
 
+/*
+ * Element generators. They return candidates, generate_set throws
+ * away the ones that are already in the set.
+ */
+
+/* Same as the old sets, but with its own random numbers. */
+static unsigned int
+gen_uniform(struct test_set *ts, struct gen_state *gs)
+{
+	return nrand48(gs->xsubi) % ts->bmapsz;
+}
+
+/* Runs of consecutive elements, 1 to 2000 long, at random places. */
+static unsigned int
+gen_runs(struct test_set *ts, struct gen_state *gs)
+{
+	if (gs->left == 0 || gs->cur >= ts->bmapsz) {
+		gs->cur = nrand48(gs->xsubi) % ts->bmapsz;
+		gs->left = 1 + nrand48(gs->xsubi) % 2000;
+	}
+	gs->left--;
+	return gs->cur++;
+}
+
+/*
+ * Bursts of 100 elements at random places with power law (pareto,
+ * alpha 1.2) gaps between them. Mostly close together with the odd
+ * long jump.
+ */
+static unsigned int
+gen_clustered(struct test_set *ts, struct gen_state *gs)
+{
+	if (gs->left == 0) {
+		gs->cur = nrand48(gs->xsubi) % ts->bmapsz;
+		gs->left = 100;
+	}
+	gs->left--;
+	gs->cur += (unsigned int)pow(1.0 - erand48(gs->xsubi), -1.0 / 1.2);
+	gs->cur %= ts->bmapsz;
+	return gs->cur;
+}
+
+/*
+ * The bitmap is split into 1000 regions, the regions are picked with
+ * a zipf (s = 1) distribution and then the element is uniform in the
+ * region. The hot regions are scattered over the bitmap.
+ */
+#define ZIPF_REGIONS 1000
+
+static unsigned int
+gen_zipf(struct test_set *ts, struct gen_state *gs)
+{
+	unsigned int rsz = ts->bmapsz / ZIPF_REGIONS;
+	unsigned int rank = (unsigned int)exp(erand48(gs->xsubi) * log(ZIPF_REGIONS + 1.0)) - 1;
+	unsigned int region = (rank * 7919U) % ZIPF_REGIONS;
+
+	return region * rsz + nrand48(gs->xsubi) % rsz;
+}
+
+/*
+ * Gaps between elements are either 1 to 4 (90%) or long. The long
+ * gaps are uniform up to twice the mean that makes the elements span
+ * the whole bitmap, about 10 times the average gap of a uniform set.
+ */
+static unsigned int
+gen_bimodal(struct test_set *ts, struct gen_state *gs)
+{
+	double avg = (double)ts->bmapsz / ts->nelems;
+	unsigned int longgap = 2 * (avg - 0.9 * 2.5) / 0.1;
+
+	if (erand48(gs->xsubi) < 0.9)
+		gs->cur += 1 + nrand48(gs->xsubi) % 4;
+	else if (longgap)
+		gs->cur += nrand48(gs->xsubi) % longgap;
+	gs->cur %= ts->bmapsz;
+	return gs->cur;
+}
+
 static void
 generate_set(struct test_set *ts)
 {
 	struct bmap_interface *bi = &bmap_dumb;		/* good enough for our needs. */
 	void *b = bi->alloc(ts->bmapsz);
+	struct gen_state gs = { { ts->seed, 0, 0x330e } };
 	int i;
 
 	ts->arr = malloc(sizeof(*ts->arr) * ts->nelems);
@@ -116,7 +554,7 @@ generate_set(struct test_set *ts)
 		unsigned int x;
 
 		do {
-			x = random() % ts->bmapsz;
+			x = ts->gen ? ts->gen(ts, &gs) : random() % ts->bmapsz;
 		} while (bi->isset(b, x));
 		bi->set(b, x);
 		ts->arr[i] = x;	
@@ -126,6 +564,65 @@ generate_set(struct test_set *ts)
 	qsort(ts->arr, ts->nelems, sizeof(*ts->arr), uintcmp);
 }
 
+/* Expected counts for the count test. */
+static void
+generate_slices(struct test_set *ts)
+{
+	int i;
+
+	for (i = 0; i < ts->nelems; i++)
+		ts->slices[(uint64_t)ts->arr[i] * howmany(ts->slices) / ts->bmapsz]++;
+}
+
+static void
+generate_ranges(struct test_set *ts)
+{
+	int i;
+
+	ts->arr = malloc(sizeof(*ts->arr) * ts->nelems);
+	for (i = 0; i < ts->nelems; i++) {
+		ts->arr[i] = random() % (ts->bmapsz - ts->rangelen);
+		ts->arr[i] -= ts->arr[i] % ts->rangealign;
+	}
+}
+
+static void
+generate_unsorted(struct test_set *ts)
+{
+	int i;
+
+	ts->arr = malloc(sizeof(*ts->arr) * ts->nelems);
+	for (i = 0; i < ts->nelems; i++)
+		ts->arr[i] = random() % ts->bmapsz;
+}
+
+/*
+ * Separate from generate_set so that the sets stay the same as
+ * they were before the probes were added.
+ */
+static void
+generate_probes(struct test_set *ts)
+{
+	unsigned short xsubi[3] = { ts->seed, 1, 0x330e };
+	int i;
+
+	ts->probes = malloc(sizeof(*ts->probes) * NPROBES);
+	ts->probe_res = malloc(sizeof(*ts->probe_res) * NPROBES);
+	for (i = 0; i < NPROBES; i++) {
+		unsigned int lo = 0, hi = ts->nelems;
+
+		ts->probes[i] = (ts->gen ? nrand48(xsubi) : random()) % ts->bmapsz;
+		while (lo < hi) {
+			unsigned int mid = (lo + hi) / 2;
+			if (ts->arr[mid] < ts->probes[i])
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		ts->probe_res[i] = lo < ts->nelems ? ts->arr[lo] : BMAP_INVALID_OFF;
+	}
+}
+
 static void
 populate(struct bmap_interface *bi, struct test_set *ts, void *v)
 {
@@ -149,81 +646,1445 @@ check(struct bmap_interface *bi, struct test_set *ts, void *v)
 	}
 }
 
+/*
+ * Unlike check, which always asks for the bit right after the
+ * previous one, this starts every first_set at a random point. On
+ * the sparse sets that means a full climb and descent of the
+ * pyramid every time, which is what we want to see the latency of.
+ */
 static void
-run_and_measure(void (*fn)(struct bmap_interface *bi, struct test_set *ts, void *v), struct bmap_interface *bi, struct test_set *ts, void *bmap, const char *statdir, const char *name)
+probe(struct bmap_interface *bi, struct test_set *ts, void *v)
 {
-	struct stopwatch sw;
-	FILE *statfile;
-	int rep, toprep;
-	unsigned int nrep = 100000000 / ts->bmapsz;
+	int i;
 
-	if (statdir) {
-		char fname[PATH_MAX];
-		snprintf(fname, sizeof(fname), "%s/%s", statdir, name);
-		if ((statfile = fopen(fname, "w+")) == NULL)
-			err(1, "fopen(%s)", fname);
+	for (i = 0; i < NPROBES; i++) {
+		unsigned int n = bi->first_set(v, ts->probes[i]);
+		if (n != ts->probe_res[i])
+			errx(1, "bad first_set(%u) -> %u != %u\n", ts->probes[i], n, ts->probe_res[i]);
 	}
+}
 
-	for (toprep = 0; toprep < (statdir ? 100 : 1); toprep++) {
-		stopwatch_reset(&sw);
-		stopwatch_start(&sw);
-		for (rep = 0; rep < nrep; rep++) {
-			(*fn)(bi, ts, bmap);
-		}
-		stopwatch_stop(&sw);
-		printf("%s: %f\n", name, stopwatch_to_ns(&sw) / 1000000000.0);
-		if (statdir)
-			fprintf(statfile, "%f\n", stopwatch_to_ns(&sw) / 1000000000.0);
-	}
+/*
+ * Count cache misses if the OS lets us. Returns -1 when we can't
+ * (not linux, no perf support or not allowed), the callers just
+ * don't report misses then.
+ */
+static int
+cache_misses_open(void)
+{
+#ifdef __linux__
+	struct perf_event_attr pe;
 
-	if (statdir)
-		fclose(statfile);
+	memset(&pe, 0, sizeof(pe));
+	pe.type = PERF_TYPE_HARDWARE;
+	pe.size = sizeof(pe);
+	pe.config = PERF_COUNT_HW_CACHE_MISSES;
+	pe.disabled = 1;
+	pe.exclude_kernel = 1;
+	pe.exclude_hv = 1;
+	return syscall(__NR_perf_event_open, &pe, 0, -1, -1, 0);
+#else
+	return -1;
+#endif
 }
 
 static void
-test_one(struct bmap_interface *bi, const char *test_name, struct test_set *ts, const char *statdir)
+cache_misses_start(int fd)
 {
-	char name[PATH_MAX];
-	void *bmap;
+#ifdef __linux__
+	if (fd == -1)
+		return;
+	ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+	ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+#endif
+}
 
-	bmap = bi->alloc(ts->bmapsz);
-	
-	snprintf(name, sizeof(name), "%s-%s-populate", test_name, ts->set_name);
-	run_and_measure(populate, bi, ts, bmap, statdir, name);
+static long long
+cache_misses_stop(int fd)
+{
+	long long n = -1;
+#ifdef __linux__
+	if (fd == -1)
+		return -1;
+	ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+	if (read(fd, &n, sizeof(n)) != sizeof(n))
+		n = -1;
+#endif
+	return n;
+}
 
-	snprintf(name, sizeof(name), "%s-%s-check", test_name, ts->set_name);
-	run_and_measure(check, bi, ts, bmap, statdir, name);
+/*
+ * Count the whole bitmap and then each 1/16th of it.
+ */
+static void
+count(struct bmap_interface *bi, struct test_set *ts, void *v)
+{
+	unsigned int n;
+	int i;
 
-	bi->free(bmap);
+	if ((n = bi->count_range(v, 0, ts->bmapsz)) != ts->nelems)
+		errx(1, "bad count_range(0, %u) -> %u != %u\n", ts->bmapsz, n, ts->nelems);
+	for (i = 0; i < howmany(ts->slices); i++) {
+		unsigned int lo = (uint64_t)ts->bmapsz * i / howmany(ts->slices);
+		unsigned int hi = (uint64_t)ts->bmapsz * (i + 1) / howmany(ts->slices);
+
+		if ((n = bi->count_range(v, lo, hi)) != ts->slices[i])
+			errx(1, "bad count_range(%u, %u) -> %u != %u\n", lo, hi, n, ts->slices[i]);
+	}
 }
 
-int
-main(int argc, char **argv)
+static void
+batch_set(struct bmap_interface *bi, struct test_set *ts, void *v)
 {
-	const char *statdir = NULL;
-	int t;
+	bi->set_batch(v, ts->arr, ts->nelems);
+}
 
-	srandom(4711);
+/*
+ * Sort and then set in order, which is what a bulk load of unsorted
+ * input would do.
+ */
+static void
+batch_sort_set(struct bmap_interface *bi, struct test_set *ts, void *v)
+{
+	unsigned int *s = malloc(sizeof(*s) * ts->nelems);
+	int i;
 
-	for (t = 0; t < howmany(test_sets); t++) {
-		generate_set(&test_sets[t]);
-	}
+	memcpy(s, ts->arr, sizeof(*s) * ts->nelems);
+	qsort(s, ts->nelems, sizeof(*s), uintcmp);
+	for (i = 0; i < ts->nelems; i++)
+		bi->set(v, s[i]);
+	free(s);
+}
 
-	/* If called with an argument we'll try to generate a set of stats data we can use with ministat. */
-	if (argc > 1) {
-		statdir = argv[1];
-	}
+/*
+ * Walk all the elements, one first_set per element or one next_run
+ * per run of elements.
+ */
+static void
+walk_elements(struct bmap_interface *bi, struct test_set *ts, void *v)
+{
+	unsigned int b, n = 0;
 
-	for (t = 0; t < howmany(tests); t++) {
-		smoke_test(tests[t].bi, tests[t].n);
-	}
+	for (b = bi->first_set(v, 0); b != BMAP_INVALID_OFF; b = bi->first_set(v, b + 1))
+		n++;
+	if (n != ts->nelems)
+		errx(1, "walk found %u elements, expected %u", n, ts->nelems);
+}
 
-	for (t = 0; t < howmany(tests); t++) {
-		int s;
+static void
+walk_runs(struct bmap_interface *bi, struct test_set *ts, void *v)
+{
+	unsigned int s, e = 0, n = 0;
 
-		for (s = 0; s < howmany(test_sets); s++)
-			test_one(tests[t].bi, tests[t].n, &test_sets[s], statdir);
+	while (bi->next_run(v, e, &s, &e))
+		n += e - s;
+	if (n != ts->nelems)
+		errx(1, "walk found %u elements in runs, expected %u", n, ts->nelems);
+}
+
+/*
+ * Start from an empty bitmap and let it grow, or allocate the final
+ * size up front.
+ */
+static void
+grow_populate(struct bmap_interface *bi, struct test_set *ts, void *v)
+{
+	void *g = bi->alloc(0);
+
+	populate(bi, ts, g);
+	bi->free(g);
+}
+
+static void
+prealloc_populate(struct bmap_interface *bi, struct test_set *ts, void *v)
+{
+	void *g = bi->alloc(ts->bmapsz);
+
+	populate(bi, ts, g);
+	bi->free(g);
+}
+
+/*
+ * populate, check and probe with the inlined p64v3switch set and
+ * p64v3r first_set instead of calls through the interface.
+ */
+static void
+inline_populate(struct bmap_interface *bi, struct test_set *ts, void *v)
+{
+	int i;
+
+	for (i = 0; i < ts->nelems; i++)
+		bmap_p64v3switch_set(v, ts->arr[i]);
+}
+
+static void
+inline_check(struct bmap_interface *bi, struct test_set *ts, void *v)
+{
+	unsigned int last = 0;
+	int i;
+
+	for (i = 0; i < ts->nelems; i++) {
+		unsigned int n = bmap_p64v3r_first_set(v, last);
+		if (n != ts->arr[i])
+			errx(1, "bad first_set(%u) -> %u != %u\n", last, n, ts->arr[i]);
+		last = n + 1;
+	}
+}
+
+static void
+inline_probe(struct bmap_interface *bi, struct test_set *ts, void *v)
+{
+	int i;
+
+	for (i = 0; i < NPROBES; i++) {
+		unsigned int n = bmap_p64v3r_first_set(v, ts->probes[i]);
+		if (n != ts->probe_res[i])
+			errx(1, "bad first_set(%u) -> %u != %u\n", ts->probes[i], n, ts->probe_res[i]);
+	}
+}
+
+static void
+range_set(struct bmap_interface *bi, struct test_set *ts, void *v)
+{
+	int i;
+
+	for (i = 0; i < ts->nelems; i++)
+		bi->set_range(v, ts->arr[i], ts->arr[i] + ts->rangelen);
+}
+
+/*
+ * What we had to do before set_range.
+ */
+static void
+range_set_bits(struct bmap_interface *bi, struct test_set *ts, void *v)
+{
+	unsigned int b;
+	int i;
+
+	for (i = 0; i < ts->nelems; i++)
+		for (b = ts->arr[i]; b < ts->arr[i] + ts->rangelen; b++)
+			bi->set(v, b);
+}
+
+static void
+range_clear(struct bmap_interface *bi, struct test_set *ts, void *v)
+{
+	int i;
+
+	for (i = 0; i < ts->nelems; i++)
+		bi->clear_range(v, ts->arr[i], ts->arr[i] + ts->rangelen);
+}
+
+static void
+range_all(struct bmap_interface *bi, struct test_set *ts, void *v)
+{
+	int i;
+
+	for (i = 0; i < ts->nelems; i++)
+		if (!bi->all_in_range(v, ts->arr[i], ts->arr[i] + ts->rangelen))
+			errx(1, "all_in_range(%u, %u) false", ts->arr[i], ts->arr[i] + ts->rangelen);
+}
+
+static void
+range_any(struct bmap_interface *bi, struct test_set *ts, void *v)
+{
+	int i;
+
+	for (i = 0; i < ts->nelems; i++)
+		if (!bi->any_in_range(v, ts->arr[i], ts->arr[i] + ts->rangelen))
+			errx(1, "any_in_range(%u, %u) false", ts->arr[i], ts->arr[i] + ts->rangelen);
+}
+
+/*
+ * any_in_range on a cleared bitmap, this should be answered from
+ * the top levels.
+ */
+static void
+range_none(struct bmap_interface *bi, struct test_set *ts, void *v)
+{
+	int i;
+
+	for (i = 0; i < ts->nelems; i++)
+		if (bi->any_in_range(v, ts->arr[i], ts->arr[i] + ts->rangelen))
+			errx(1, "any_in_range(%u, %u) true", ts->arr[i], ts->arr[i] + ts->rangelen);
+}
+
+/*
+ * What every request does with a shared base set: clone it and set a
+ * few bits of its own. The probes are as good random bits as any.
+ */
+#define CLONE_WRITES 16
+
+static void
+clone_modify(struct bmap_interface *bi, struct test_set *ts, void *v)
+{
+	void *c = bi->clone(v);
+	int i;
+
+	for (i = 0; i < CLONE_WRITES; i++)
+		bi->set(c, ts->probes[i]);
+	bi->free(c);
+}
+
+/* Same as clone_modify and then walk the clone. */
+static void
+clone_iterate(struct bmap_interface *bi, struct test_set *ts, void *v)
+{
+	void *c = bi->clone(v);
+	unsigned int last, n = 0;
+	int i;
+
+	for (i = 0; i < CLONE_WRITES; i++)
+		bi->set(c, ts->probes[i]);
+	for (last = bi->first_set(c, 0); last != BMAP_INVALID_OFF; last = bi->first_set(c, last + 1))
+		n++;
+	if (n < ts->nelems || n > ts->nelems + CLONE_WRITES)
+		errx(1, "bad number of bits in clone %u, expected %u + up to %u", n, ts->nelems, CLONE_WRITES);
+	bi->free(c);
+}
+
+#ifdef BMAP_INSTRUMENT
+/*
+ * Dump the first_set histograms collected during one test, as
+ * percentages of the calls since the counts scale with nrep.
+ */
+static void
+fs_stats_dump(FILE *f, const char *name)
+{
+	struct bmap_fs_stats *st = &bmap_fs_stats;
+	int i;
+
+	if (st->calls == 0)
+		return;
+	fprintf(f, "%s: %llu first_set calls, %.1f%% level 0 peek hits\n", name,
+	    st->calls, 100.0 * st->peek_hits / st->calls);
+	fprintf(f, "%6s %8s %8s %8s %8s\n", "n", "depth", "climbs", "descents", "words");
+	for (i = 0; i < BMAP_FS_HIST; i++) {
+		if (!st->depth[i] && !st->climbs[i] && !st->descents[i] && !st->words[i])
+			continue;
+		fprintf(f, "%5d%s %7.2f%% %7.2f%% %7.2f%% %7.2f%%\n", i, i == BMAP_FS_HIST - 1 ? "+" : " ",
+		    100.0 * st->depth[i] / st->calls, 100.0 * st->climbs[i] / st->calls,
+		    100.0 * st->descents[i] / st->calls, 100.0 * st->words[i] / st->calls);
+	}
+}
+#endif
+
+static void
+run_and_measure(void (*fn)(struct bmap_interface *bi, struct test_set *ts, void *v), struct bmap_interface *bi, struct test_set *ts, void *bmap, const char *statdir, const char *name)
+{
+	struct stopwatch sw;
+	FILE *statfile = NULL;
+	int rep, toprep;
+	unsigned int nrep = 100000000 / ts->bmapsz;
+	int missfd = cache_misses_open();
+	long long misses;
+
+	if (statdir) {
+		char fname[PATH_MAX];
+		if (snprintf(fname, sizeof(fname), "%s/%s", statdir, name) >= sizeof(fname))
+			errx(1, "%s/%s: name too long", statdir, name);
+		if ((statfile = fopen(fname, "w+")) == NULL)
+			err(1, "fopen(%s)", fname);
+	}
+
+#ifdef BMAP_INSTRUMENT
+	memset(&bmap_fs_stats, 0, sizeof(bmap_fs_stats));
+#endif
+	for (toprep = 0; toprep < (statdir ? 100 : 1); toprep++) {
+		stopwatch_reset(&sw);
+		cache_misses_start(missfd);
+		stopwatch_start(&sw);
+		for (rep = 0; rep < nrep; rep++) {
+			(*fn)(bi, ts, bmap);
+		}
+		stopwatch_stop(&sw);
+		misses = cache_misses_stop(missfd);
+		if (misses != -1)
+			printf("%s: %f (%lld cache misses)\n", name, stopwatch_to_ns(&sw) / 1000000000.0, misses);
+		else
+			printf("%s: %f\n", name, stopwatch_to_ns(&sw) / 1000000000.0);
+		if (statdir)
+			fprintf(statfile, "%f\n", stopwatch_to_ns(&sw) / 1000000000.0);
+	}
+
+	if (statdir)
+		fclose(statfile);
+	if (missfd != -1)
+		close(missfd);
+
+#ifdef BMAP_INSTRUMENT
+	fs_stats_dump(stdout, name);
+	if (statdir && bmap_fs_stats.calls) {
+		char fname[PATH_MAX];
+		if (snprintf(fname, sizeof(fname), "%s/%s-hist", statdir, name) >= sizeof(fname))
+			errx(1, "%s/%s-hist: name too long", statdir, name);
+		if ((statfile = fopen(fname, "w+")) == NULL)
+			err(1, "fopen(%s)", fname);
+		fs_stats_dump(statfile, name);
+		fclose(statfile);
+	}
+	memset(&bmap_fs_stats, 0, sizeof(bmap_fs_stats));
+#endif
+}
+
+static void
+test_one(struct bmap_interface *bi, const char *test_name, struct test_set *ts, const char *statdir)
+{
+	char name[PATH_MAX];
+	void *bmap;
+
+	bmap = bi->alloc(ts->bmapsz);
+	
+	snprintf(name, sizeof(name), "%s-%s-populate", test_name, ts->set_name);
+	run_and_measure(populate, bi, ts, bmap, statdir, name);
+
+	snprintf(name, sizeof(name), "%s-%s-check", test_name, ts->set_name);
+	run_and_measure(check, bi, ts, bmap, statdir, name);
+
+	snprintf(name, sizeof(name), "%s-%s-probe", test_name, ts->set_name);
+	run_and_measure(probe, bi, ts, bmap, statdir, name);
+
+	if (bi->count_range) {
+		snprintf(name, sizeof(name), "%s-%s-count", test_name, ts->set_name);
+		run_and_measure(count, bi, ts, bmap, statdir, name);
+	}
+
+	if (bi->clone) {
+		snprintf(name, sizeof(name), "%s-%s-clone", test_name, ts->set_name);
+		run_and_measure(clone_modify, bi, ts, bmap, statdir, name);
+
+		snprintf(name, sizeof(name), "%s-%s-clone_iterate", test_name, ts->set_name);
+		run_and_measure(clone_iterate, bi, ts, bmap, statdir, name);
+	}
+
+	bi->free(bmap);
+}
+
+/*
+ * Memory used by every implementation for every set after populate,
+ * allocated and resident (see struct bmap_mem_usage) per element and
+ * per bit of the bitmap.
+ */
+static void
+mem_table(void)
+{
+	int t, s;
+
+	printf("%-12s %-13s %10s %10s %9s %9s %7s %7s\n", "mem", "set", "allocated", "resident",
+	    "B/elem", "res/elem", "B/bit", "res/bit");
+	for (t = 0; t < howmany(tests); t++) {
+		if (tests[t].bi->mem_usage == NULL)
+			continue;
+		for (s = 0; s < howmany(test_sets); s++) {
+			struct test_set *ts = &test_sets[s];
+			struct bmap_mem_usage mu;
+			void *bmap = tests[t].bi->alloc(ts->bmapsz);
+
+			populate(tests[t].bi, ts, bmap);
+			tests[t].bi->mem_usage(bmap, &mu);
+			printf("%-12s %-13s %10zu %10zu %9.2f %9.2f %7.4f %7.4f\n", tests[t].n, ts->set_name,
+			    mu.allocated, mu.resident,
+			    (double)mu.allocated / ts->nelems, (double)mu.resident / ts->nelems,
+			    (double)mu.allocated / ts->bmapsz, (double)mu.resident / ts->bmapsz);
+			tests[t].bi->free(bmap);
+		}
+	}
+}
+
+/*
+ * Concurrent readers.
+ *
+ * The writer sets CONC_NIDS random bits in random order while the
+ * readers call first_set from random points until the writer is done.
+ * Every result is checked against a bitmap with all the bits the
+ * writer will set, since all we can say about a result while the
+ * writer is running is that it should be one of those.
+ */
+#define CONC_BMAPSZ 25000000
+#define CONC_NIDS 2000000
+
+struct conc {
+	struct bmap_interface *bi;
+	void *v;
+	void *ref;
+	pthread_mutex_t *mtx;
+	bool done;
+};
+
+struct conc_reader {
+	struct conc *c;
+	pthread_t thr;
+	unsigned int seed;
+	unsigned long long reads;
+};
+
+static void *
+conc_reader(void *arg)
+{
+	struct conc_reader *cr = arg;
+	struct conc *c = cr->c;
+
+	while (!__atomic_load_n(&c->done, __ATOMIC_RELAXED)) {
+		unsigned int b = rand_r(&cr->seed) % CONC_BMAPSZ;
+		unsigned int r;
+
+		if (c->mtx)
+			pthread_mutex_lock(c->mtx);
+		r = c->bi->first_set(c->v, b);
+		if (c->mtx)
+			pthread_mutex_unlock(c->mtx);
+		if (r != BMAP_INVALID_OFF && (r < b || !bmap_dumb.isset(c->ref, r)))
+			errx(1, "concurrent first_set(%u) -> %u which was never set", b, r);
+		cr->reads++;
+	}
+	return NULL;
+}
+
+static void
+test_concurrent(struct bmap_interface *bi, const char *test_name, bool lock, int nreaders, unsigned int *ids, void *ref)
+{
+	pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
+	struct conc_reader cr[nreaders];
+	struct conc c = { bi, bi->alloc(CONC_BMAPSZ), ref, lock ? &mtx : NULL, false };
+	unsigned long long reads = 0;
+	struct stopwatch sw, wsw;
+	unsigned int b, r;
+	double secs;
+	int i;
+
+	stopwatch_reset(&sw);
+	stopwatch_start(&sw);
+	for (i = 0; i < nreaders; i++) {
+		cr[i].c = &c;
+		cr[i].seed = 4711 + i;
+		cr[i].reads = 0;
+		if (pthread_create(&cr[i].thr, NULL, conc_reader, &cr[i]))
+			errx(1, "pthread_create");
+	}
+	stopwatch_reset(&wsw);
+	stopwatch_start(&wsw);
+	for (i = 0; i < CONC_NIDS; i++) {
+		if (c.mtx)
+			pthread_mutex_lock(c.mtx);
+		bi->set(c.v, ids[i]);
+		if (c.mtx)
+			pthread_mutex_unlock(c.mtx);
+	}
+	stopwatch_stop(&wsw);
+	__atomic_store_n(&c.done, true, __ATOMIC_RELAXED);
+	for (i = 0; i < nreaders; i++) {
+		pthread_join(cr[i].thr, NULL);
+		reads += cr[i].reads;
+	}
+	stopwatch_stop(&sw);
+	secs = stopwatch_to_ns(&sw) / 1000000000.0;
+	printf("%s-concurrent-%d: %f Mreads/s (%f per reader), writer %f\n", test_name, nreaders,
+	    reads / secs / 1000000.0, reads / secs / 1000000.0 / nreaders, stopwatch_to_ns(&wsw) / 1000000000.0);
+
+	/* Walk it, isset only looks at level 0 and not the summaries. */
+	for (b = 0; (r = bmap_dumb.first_set(ref, b)) != BMAP_INVALID_OFF; b = r + 1)
+		if (bi->first_set(c.v, b) != r)
+			errx(1, "%s concurrent test first_set(%u) != %u", test_name, b, r);
+	if (bi->first_set(c.v, b) != BMAP_INVALID_OFF)
+		errx(1, "%s concurrent test has extra bits after %u", test_name, b);
+	bi->free(c.v);
+}
+
+/*
+ * Freeze a populated bitmap and run check and probe on the frozen
+ * one. Compare the memory use with the bitmap it came from.
+ */
+static void
+test_frozen(struct bmap_interface *bi, const char *test_name, struct test_set *ts, const char *statdir)
+{
+	struct bmap_mem_usage mu, fmu;
+	char name[PATH_MAX];
+	void *bmap, *frozen;
+
+	bmap = bi->alloc(ts->bmapsz);
+	populate(bi, ts, bmap);
+	frozen = bi->freeze(bmap);
+
+	snprintf(name, sizeof(name), "ef-%s-check", ts->set_name);
+	run_and_measure(check, &bmap_ef, ts, frozen, statdir, name);
+
+	snprintf(name, sizeof(name), "ef-%s-probe", ts->set_name);
+	run_and_measure(probe, &bmap_ef, ts, frozen, statdir, name);
+
+	bi->mem_usage(bmap, &mu);
+	bmap_ef.mem_usage(frozen, &fmu);
+	printf("ef-%s-mem: %zu bytes, %.2f per element (%s %zu bytes, %.2f per element)\n", ts->set_name,
+	    fmu.allocated, (double)fmu.allocated / ts->nelems, test_name, mu.allocated, (double)mu.allocated / ts->nelems);
+
+	bmap_ef.free(frozen);
+	bi->free(bmap);
+}
+
+/*
+ * Union of many bitmaps of mixed density: every 8th input is dense
+ * (1 in 10 bits), every 8th is dense in one 2^18 bit area and the
+ * rest are sparse (1 in 1000). union_many is compared with walking
+ * every input with first_set and setting the bits in the output,
+ * which is all we can do through the interface without it.
+ */
+#define UNION_BMAPSZ 4000000
+#define UNION_MAXINPUTS 512
+
+static void
+test_union(struct bmap_interface *bi, const char *test_name, void **in, size_t n)
+{
+	struct stopwatch sw;
+	void *u, *w;
+	unsigned int b, c;
+	size_t i;
+
+	stopwatch_reset(&sw);
+	stopwatch_start(&sw);
+	u = bi->union_many(in, n);
+	stopwatch_stop(&sw);
+	printf("%s-union-%zu: %f\n", test_name, n, stopwatch_to_ns(&sw) / 1000000000.0);
+
+	stopwatch_reset(&sw);
+	stopwatch_start(&sw);
+	w = bi->alloc(UNION_BMAPSZ);
+	for (i = 0; i < n; i++)
+		for (b = bi->first_set(in[i], 0); b != BMAP_INVALID_OFF; b = bi->first_set(in[i], b + 1))
+			bi->set(w, b);
+	stopwatch_stop(&sw);
+	printf("%s-union_walk-%zu: %f\n", test_name, n, stopwatch_to_ns(&sw) / 1000000000.0);
+
+	for (b = 0; (c = bi->first_set(w, b)) != BMAP_INVALID_OFF; b = c + 1)
+		if (bi->first_set(u, b) != c)
+			errx(1, "%s union of %zu first_set(%u) != %u", test_name, n, b, c);
+	if (bi->first_set(u, b) != BMAP_INVALID_OFF)
+		errx(1, "%s union of %zu has extra bits after %u", test_name, n, b);
+	bi->free(u);
+	bi->free(w);
+}
+
+static void
+test_unions(struct bmap_interface *bi, const char *test_name)
+{
+	void *in[UNION_MAXINPUTS];
+	size_t i, n;
+	int j;
+
+	for (i = 0; i < UNION_MAXINPUTS; i++) {
+		in[i] = bi->alloc(UNION_BMAPSZ);
+		if (i % 8 == 0) {
+			for (j = 0; j < UNION_BMAPSZ / 10; j++)
+				bi->set(in[i], random() % UNION_BMAPSZ);
+		} else if (i % 8 == 1) {
+			unsigned int lo = random() % (UNION_BMAPSZ - (1 << 18));
+
+			for (j = 0; j < (1 << 18) / 4; j++)
+				bi->set(in[i], lo + random() % (1 << 18));
+		} else {
+			for (j = 0; j < UNION_BMAPSZ / 1000; j++)
+				bi->set(in[i], random() % UNION_BMAPSZ);
+		}
+	}
+	if (bi->union_many(in, 0) != NULL)
+		errx(1, "%s union of nothing isn't NULL", test_name);
+	for (n = 16; n <= UNION_MAXINPUTS; n *= 2)
+		test_union(bi, test_name, in, n);
+	for (i = 0; i < UNION_MAXINPUTS; i++)
+		bi->free(in[i]);
+}
+
+/*
+ * Setting unsorted bits. The bitmaps are checked against each other
+ * since populate, set_batch and sort_set should end up with the same
+ * bits.
+ */
+static void
+test_batch(struct bmap_interface *bi, const char *test_name, struct test_set *ts, const char *statdir)
+{
+	static void (*fns[])(struct bmap_interface *, struct test_set *, void *) = { populate, batch_set, batch_sort_set };
+	static const char *fn_names[] = { "set", "set_batch", "sort_set" };
+	char name[PATH_MAX];
+	void *bmap[howmany(fns)];
+	unsigned int b, c;
+	int i;
+
+	for (i = 0; i < howmany(fns); i++) {
+		bmap[i] = bi->alloc(ts->bmapsz);
+		snprintf(name, sizeof(name), "%s-%s-%s", test_name, ts->set_name, fn_names[i]);
+		run_and_measure(fns[i], bi, ts, bmap[i], statdir, name);
+	}
+	for (i = 1; i < howmany(fns); i++) {
+		for (b = 0; (c = bi->first_set(bmap[0], b)) != BMAP_INVALID_OFF; b = c + 1)
+			if (bi->first_set(bmap[i], b) != c)
+				errx(1, "%s %s %s first_set(%u) != %u", test_name, ts->set_name, fn_names[i], b, c);
+		if (bi->first_set(bmap[i], b) != BMAP_INVALID_OFF)
+			errx(1, "%s %s %s extra bits after %u", test_name, ts->set_name, fn_names[i], b);
+	}
+	for (i = 0; i < howmany(fns); i++)
+		bi->free(bmap[i]);
+}
+
+static void
+test_runs(struct bmap_interface *bi, const char *test_name, struct test_set *ts, const char *statdir)
+{
+	char name[PATH_MAX];
+	void *bmap;
+
+	bmap = bi->alloc(ts->bmapsz);
+	populate(bi, ts, bmap);
+
+	snprintf(name, sizeof(name), "%s-%s-walk", test_name, ts->set_name);
+	run_and_measure(walk_elements, bi, ts, bmap, statdir, name);
+
+	snprintf(name, sizeof(name), "%s-%s-walk_runs", test_name, ts->set_name);
+	run_and_measure(walk_runs, bi, ts, bmap, statdir, name);
+
+	bi->free(bmap);
+}
+
+/*
+ * The inlined functions from bmap_inline.h, compare with
+ * p64v3switch-*-populate and p64v3r-*-check/probe.
+ */
+static void
+test_inline(struct test_set *ts, const char *statdir)
+{
+	char name[PATH_MAX];
+	void *bmap;
+
+	bmap = bmap_p64v3r.alloc(ts->bmapsz);
+
+	snprintf(name, sizeof(name), "inline-%s-populate", ts->set_name);
+	run_and_measure(inline_populate, &bmap_p64v3r, ts, bmap, statdir, name);
+
+	snprintf(name, sizeof(name), "inline-%s-check", ts->set_name);
+	run_and_measure(inline_check, &bmap_p64v3r, ts, bmap, statdir, name);
+
+	snprintf(name, sizeof(name), "inline-%s-probe", ts->set_name);
+	run_and_measure(inline_probe, &bmap_p64v3r, ts, bmap, statdir, name);
+
+	bmap_p64v3r.free(bmap);
+}
+
+/*
+ * What bmap_auto picks for a set with and without a density hint and
+ * how much slower that is than the fastest candidate for populate,
+ * check and probe on this set.
+ */
+static double
+auto_time(struct bmap_interface *bi, struct test_set *ts, void *bmap)
+{
+	struct stopwatch sw;
+
+	stopwatch_reset(&sw);
+	stopwatch_start(&sw);
+	populate(bi, ts, bmap);
+	check(bi, ts, bmap);
+	probe(bi, ts, bmap);
+	stopwatch_stop(&sw);
+	return stopwatch_to_ns(&sw);
+}
+
+static void
+test_auto(struct test_set *ts)
+{
+	void *hinted = bmap_auto_alloc_hint(ts->bmapsz, (double)ts->nelems / ts->bmapsz);
+	void *unhinted = bmap_auto.alloc(ts->bmapsz);
+	const char *chosen = bmap_auto_choice(hinted), *best = NULL, *n;
+	double chosen_t = 0, unhinted_t = 0, best_t = 0;
+	int c, t;
+
+	for (c = 0; (n = bmap_auto_candidate(c)) != NULL; c++) {
+		for (t = 0; t < howmany(tests); t++) {
+			void *bmap;
+			double tm;
+			int rep;
+
+			if (strcmp(tests[t].n, n))
+				continue;
+			bmap = tests[t].bi->alloc(ts->bmapsz);
+			for (tm = 0, rep = 0; rep < 5; rep++) {
+				double r = auto_time(tests[t].bi, ts, bmap);
+				if (rep == 0 || r < tm)
+					tm = r;
+			}
+			tests[t].bi->free(bmap);
+			if (best == NULL || tm < best_t) {
+				best = n;
+				best_t = tm;
+			}
+			if (!strcmp(n, chosen))
+				chosen_t = tm;
+			if (!strcmp(n, bmap_auto_choice(unhinted)))
+				unhinted_t = tm;
+		}
+	}
+	printf("auto-%s: chose %s (%.1f%% slower than best), without hint %s (%.1f%%), best %s\n",
+	    ts->set_name, chosen, 100.0 * (chosen_t - best_t) / best_t,
+	    bmap_auto_choice(unhinted), 100.0 * (unhinted_t - best_t) / best_t, best);
+	bmap_auto.free(hinted);
+	bmap_auto.free(unhinted);
+}
+
+static void
+test_grow(struct test_set *ts, const char *statdir)
+{
+	char name[PATH_MAX];
+
+	snprintf(name, sizeof(name), "p64v3g-%s-grow", ts->set_name);
+	run_and_measure(grow_populate, &bmap_p64v3g, ts, NULL, statdir, name);
+
+	snprintf(name, sizeof(name), "p64v3g-%s-prealloc", ts->set_name);
+	run_and_measure(prealloc_populate, &bmap_p64v3g, ts, NULL, statdir, name);
+}
+
+static void
+test_range(struct bmap_interface *bi, const char *test_name, struct test_set *ts, const char *statdir)
+{
+	char name[PATH_MAX];
+	void *bmap;
+
+	bmap = bi->alloc(ts->bmapsz);
+
+	snprintf(name, sizeof(name), "%s-%s-set_bits", test_name, ts->set_name);
+	run_and_measure(range_set_bits, bi, ts, bmap, statdir, name);
+	range_clear(bi, ts, bmap);
+
+	snprintf(name, sizeof(name), "%s-%s-set_range", test_name, ts->set_name);
+	run_and_measure(range_set, bi, ts, bmap, statdir, name);
+
+	snprintf(name, sizeof(name), "%s-%s-all_in_range", test_name, ts->set_name);
+	run_and_measure(range_all, bi, ts, bmap, statdir, name);
+
+	snprintf(name, sizeof(name), "%s-%s-any_in_range", test_name, ts->set_name);
+	run_and_measure(range_any, bi, ts, bmap, statdir, name);
+
+	snprintf(name, sizeof(name), "%s-%s-clear_range", test_name, ts->set_name);
+	run_and_measure(range_clear, bi, ts, bmap, statdir, name);
+
+	snprintf(name, sizeof(name), "%s-%s-none_in_range", test_name, ts->set_name);
+	run_and_measure(range_none, bi, ts, bmap, statdir, name);
+
+	bi->free(bmap);
+}
+
+/*
+ * Comparison of one implementation with another or with a baseline
+ * from an earlier run, without ministat.
+ *
+ * Every set and operation is measured in samples of as many calls as
+ * it takes to run for CMP_SAMPLE_NS, alternating between the two
+ * sides so that clock changes and other noise hit both of them the
+ * same way. Samples more than 1.5 interquartile ranges outside the
+ * quartiles are dropped and the confidence interval of the ratio of
+ * the medians comes from bootstrap resampling. We keep adding samples
+ * until the interval is narrower than CMP_PRECISION of the ratio or
+ * we have CMP_MAXSAMPLES, checking every CMP_MINSAMPLES. A set and operation has regressed when the
+ * whole interval is more than the threshold slower.
+ *
+ * A baseline file has the ISA level and implementation on the first
+ * line and then one line per set and operation with the samples that
+ * were kept. Baseline samples can't be interleaved with ours, so
+ * compare with one from the same machine in the same state.
+ */
+#define CMP_SAMPLE_NS 2000000.0
+#define CMP_MINSAMPLES 10
+#define CMP_MAXSAMPLES 200
+#define CMP_PRECISION 0.02
+#define CMP_BOOTSTRAP 1000
+
+struct cmp_side {
+	struct bmap_interface *bi;	/* NULL for a baseline */
+	void *v;
+	unsigned int calls;		/* calls per sample */
+	size_t n;
+	double s[CMP_MAXSAMPLES];	/* ns per call */
+};
+
+struct cmp_result {
+	double med;			/* median of a in ns per call */
+	double ratio, lo, hi;		/* ratio of medians and its confidence interval */
+	size_t na, nb;			/* samples kept */
+};
+
+static struct bmap_interface *
+impl_by_name(const char *n)
+{
+	int t;
+
+	for (t = 0; t < howmany(tests); t++)
+		if (!strcmp(tests[t].n, n))
+			return tests[t].bi;
+	errx(1, "unknown implementation %s", n);
+}
+
+static int
+dblcmp(const void *av, const void *bv)
+{
+	const double *a = av, *b = bv;
+
+	return *a < *b ? -1 : *a > *b;
+}
+
+static double
+median(const double *s, size_t n)
+{
+	double t[CMP_MAXSAMPLES];
+
+	memcpy(t, s, n * sizeof(*t));
+	qsort(t, n, sizeof(*t), dblcmp);
+	return n & 1 ? t[n / 2] : (t[n / 2 - 1] + t[n / 2]) / 2;
+}
+
+/* Tukey's fences, returns the number of samples kept in out. */
+static size_t
+cmp_filter(const double *s, size_t n, double *out)
+{
+	double t[CMP_MAXSAMPLES], q1, q3;
+	size_t i, k = 0;
+
+	memcpy(t, s, n * sizeof(*t));
+	qsort(t, n, sizeof(*t), dblcmp);
+	q1 = t[n / 4];
+	q3 = t[(3 * n) / 4];
+	for (i = 0; i < n; i++)
+		if (s[i] >= q1 - 1.5 * (q3 - q1) && s[i] <= q3 + 1.5 * (q3 - q1))
+			out[k++] = s[i];
+	return k;
+}
+
+static double
+resampled_median(const double *s, size_t n, unsigned short *xsubi)
+{
+	double t[CMP_MAXSAMPLES];
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		t[i] = s[nrand48(xsubi) % n];
+	return median(t, n);
+}
+
+/*
+ * Ratio of the median of a to the median of b with a 95% bootstrap
+ * confidence interval. Without b it's a to its own median, which
+ * tells how precise the median of a is.
+ */
+static void
+cmp_ci(struct cmp_side *a, struct cmp_side *b, struct cmp_result *r)
+{
+	static double rs[CMP_BOOTSTRAP];
+	unsigned short xsubi[3] = { 4711, 17, 42 };
+	double fa[CMP_MAXSAMPLES], fb[CMP_MAXSAMPLES], mb;
+	int i;
+
+	r->na = cmp_filter(a->s, a->n, fa);
+	r->nb = b ? cmp_filter(b->s, b->n, fb) : 0;
+	r->med = median(fa, r->na);
+	mb = b ? median(fb, r->nb) : r->med;
+	r->ratio = r->med / mb;
+	for (i = 0; i < CMP_BOOTSTRAP; i++)
+		rs[i] = resampled_median(fa, r->na, xsubi) / (b ? resampled_median(fb, r->nb, xsubi) : mb);
+	qsort(rs, CMP_BOOTSTRAP, sizeof(*rs), dblcmp);
+	r->lo = rs[CMP_BOOTSTRAP / 40];
+	r->hi = rs[CMP_BOOTSTRAP - 1 - CMP_BOOTSTRAP / 40];
+}
+
+static double
+cmp_sample(void (*fn)(struct bmap_interface *, struct test_set *, void *), struct cmp_side *cs, struct test_set *ts)
+{
+	struct stopwatch sw;
+	unsigned int i;
+
+	stopwatch_reset(&sw);
+	stopwatch_start(&sw);
+	for (i = 0; i < cs->calls; i++)
+		(*fn)(cs->bi, ts, cs->v);
+	stopwatch_stop(&sw);
+	return stopwatch_to_ns(&sw) / cs->calls;
+}
+
+static void
+cmp_calibrate(void (*fn)(struct bmap_interface *, struct test_set *, void *), struct cmp_side *cs, struct test_set *ts)
+{
+	cs->calls = 1;
+	while (cmp_sample(fn, cs, ts) * cs->calls < CMP_SAMPLE_NS)
+		cs->calls *= 2;
+}
+
+static bool
+cmp_baseline_read(const char *path, const char *impl, const char *name, struct cmp_side *cs)
+{
+	static bool warned;
+	char line[16384], bimpl[64], bisa[64], *p, *e;
+	bool found = false;
+	FILE *f;
+
+	if ((f = fopen(path, "r")) == NULL)
+		err(1, "fopen(%s)", path);
+	if (fgets(line, sizeof(line), f) == NULL || sscanf(line, "bmap_cmp 1 %63s %63s", bisa, bimpl) != 2)
+		errx(1, "%s: not a baseline file", path);
+	if (!warned && (strcmp(bisa, bmap_isa()) || strcmp(bimpl, impl)) && (warned = true))
+		warnx("%s is for %s on %s, comparing anyway", path, bimpl, bisa);
+	while (!found && fgets(line, sizeof(line), f) != NULL) {
+		if ((p = strchr(line, ' ')) == NULL)
+			continue;
+		*p++ = '\0';
+		if (strcmp(line, name))
+			continue;
+		for (cs->n = 0; cs->n < CMP_MAXSAMPLES; cs->n++, p = e) {
+			cs->s[cs->n] = strtod(p, &e);
+			if (e == p)
+				break;
+		}
+		found = cs->n > 0;
+	}
+	fclose(f);
+	return found;
+}
+
+/* The raw samples, cmp_ci filters them when they are read back. */
+static void
+cmp_baseline_write(FILE *f, const char *name, struct cmp_side *cs)
+{
+	size_t i;
+
+	fprintf(f, "%s", name);
+	for (i = 0; i < cs->n; i++)
+		fprintf(f, " %.1f", cs->s[i]);
+	fprintf(f, "\n");
+}
+
+static int
+compare(const char *impl, const char *ref, const char *basepath, const char *writepath, double threshold)
+{
+	static void (*fns[])(struct bmap_interface *, struct test_set *, void *) = { populate, check, probe };
+	static const char *fn_names[] = { "populate", "check", "probe" };
+	static struct cmp_side a, b;
+	struct cmp_side *other = ref || basepath ? &b : NULL;
+	/* Different implementations are expected to differ. */
+	bool gate = basepath || (ref && !strcmp(ref, impl));
+	FILE *wf = NULL;
+	int s, f, regressions = 0;
+
+	if (writepath) {
+		if ((wf = fopen(writepath, "w")) == NULL)
+			err(1, "fopen(%s)", writepath);
+		fprintf(wf, "bmap_cmp 1 %s %s\n", bmap_isa(), impl);
+	}
+	a.bi = impl_by_name(impl);
+	b.bi = ref ? impl_by_name(ref) : NULL;
+
+	for (s = 0; s < howmany(test_sets); s++) {
+		struct test_set *ts = &test_sets[s];
+
+		a.v = a.bi->alloc(ts->bmapsz);
+		populate(a.bi, ts, a.v);
+		if (b.bi) {
+			b.v = b.bi->alloc(ts->bmapsz);
+			populate(b.bi, ts, b.v);
+		}
+		for (f = 0; f < howmany(fns); f++) {
+			struct cmp_result r = { 0 };
+			char name[PATH_MAX];
+
+			snprintf(name, sizeof(name), "%s-%s", ts->set_name, fn_names[f]);
+			a.n = b.n = 0;
+			if (basepath && !cmp_baseline_read(basepath, impl, name, &b)) {
+				warnx("%s: no %s, skipped", basepath, name);
+				continue;
+			}
+			cmp_calibrate(fns[f], &a, ts);
+			if (b.bi)
+				cmp_calibrate(fns[f], &b, ts);
+			do {
+				/* ABBA so that neither side always runs first. */
+				bool odd = a.n & 1;
+
+				if (b.bi && odd)
+					b.s[b.n++] = cmp_sample(fns[f], &b, ts);
+				a.s[a.n++] = cmp_sample(fns[f], &a, ts);
+				if (b.bi && !odd)
+					b.s[b.n++] = cmp_sample(fns[f], &b, ts);
+				if (a.n % CMP_MINSAMPLES == 0)
+					cmp_ci(&a, other, &r);
+			} while (a.n < CMP_MAXSAMPLES && (a.n % CMP_MINSAMPLES || r.hi - r.lo > CMP_PRECISION * r.ratio));
+
+			if (other == NULL) {
+				printf("cmp %s-%s: %.1f ns [%.1f, %.1f] (%zu/%zu samples)\n", impl, name,
+				    r.med, r.lo * r.med, r.hi * r.med, r.na, a.n);
+			} else {
+				bool regressed = gate && r.lo > 1.0 + threshold / 100.0;
+
+				printf("cmp %s-%s vs %s: %.3f [%.3f, %.3f] (%zu/%zu, %zu/%zu samples)%s\n", impl, name,
+				    ref ? ref : basepath, r.ratio, r.lo, r.hi, r.na, a.n, r.nb, b.n,
+				    regressed ? " REGRESSION" : "");
+				regressions += regressed;
+			}
+			if (wf)
+				cmp_baseline_write(wf, name, &a);
+		}
+		a.bi->free(a.v);
+		if (b.bi)
+			b.bi->free(b.v);
+	}
+	if (wf)
+		fclose(wf);
+	if (regressions)
+		printf("cmp %s: %d regressions past %.1f%%\n", impl, regressions, threshold);
+	return regressions ? 1 : 0;
+}
+
+/*
+ * Multi-threaded throughput.
+ *
+ * n threads, each pinned to its own cpu if there are enough, run
+ * populate and check on a private bitmap each, or check on one bitmap
+ * shared by all of them. Every thread does MT_PASSES passes over the set and reads
+ * the clock every MT_BATCH operations. The latency percentiles are
+ * of the time per operation in those batches, timing every single
+ * call would cost more than most calls do.
+ */
+#define MT_PASSES 20
+#define MT_BATCH 64
+
+static const char *mt_impls[] = { "simple", "p64v3r", "p8", "p32" };
+static const char *mt_sets[] = { "mid-mid", "mid-dense", "uniform" };
+
+struct mt {
+	struct bmap_interface *bi;
+	struct test_set *ts;
+	bool setting;			/* populate instead of check */
+	int ready;
+	bool go;
+};
+
+struct mt_thread {
+	struct mt *m;
+	pthread_t thr;
+	int cpu;
+	void *v;
+	double *lat;			/* ns per operation of every batch */
+	size_t nlat;
+	double ns;			/* all passes */
+};
+
+static double
+mt_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000.0 + ts.tv_nsec;
+}
+
+static void
+mt_pin(int cpu)
+{
+#ifdef __linux__
+	cpu_set_t cs;
+
+	CPU_ZERO(&cs);
+	CPU_SET(cpu, &cs);
+	/* Not fatal, we just don't know where we run then. */
+	if (pthread_setaffinity_np(pthread_self(), sizeof(cs), &cs))
+		warnx("can't pin thread to cpu %d", cpu);
+#endif
+}
+
+static void *
+mt_thread(void *arg)
+{
+	struct mt_thread *mt = arg;
+	struct mt *m = mt->m;
+	struct test_set *ts = m->ts;
+	unsigned int i, b, e, last;
+	double start, t, now;
+	int pass;
+
+	mt_pin(mt->cpu);
+	__atomic_add_fetch(&m->ready, 1, __ATOMIC_RELEASE);
+	while (!__atomic_load_n(&m->go, __ATOMIC_ACQUIRE))
+		sched_yield();
+
+	start = t = mt_now();
+	for (pass = 0; pass < MT_PASSES; pass++) {
+		for (i = 0, last = 0; i < ts->nelems; i = e) {
+			b = i;
+			e = i + MT_BATCH < ts->nelems ? i + MT_BATCH : ts->nelems;
+			if (m->setting) {
+				for (; i < e; i++)
+					m->bi->set(mt->v, ts->arr[i]);
+			} else {
+				for (; i < e; i++) {
+					if ((last = m->bi->first_set(mt->v, last)) != ts->arr[i])
+						errx(1, "bad first_set -> %u != %u", last, ts->arr[i]);
+					last++;
+				}
+			}
+			now = mt_now();
+			mt->lat[mt->nlat++] = (now - t) / (e - b);
+			t = now;
+		}
+	}
+	mt->ns = t - start;
+	return NULL;
+}
+
+static void
+test_mt(struct bmap_interface *bi, const char *test_name, struct test_set *ts, bool setting, bool shared, int nthreads)
+{
+	struct mt m = { bi, ts, setting, 0, false };
+	struct mt_thread mt[nthreads];
+	size_t maxlat = MT_PASSES * ((ts->nelems + MT_BATCH - 1) / MT_BATCH);
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	void *sv = NULL;
+	double start;
+	int i;
+
+	if (shared) {
+		sv = bi->alloc(ts->bmapsz);
+		populate(bi, ts, sv);
+	}
+	for (i = 0; i < nthreads; i++) {
+		mt[i].m = &m;
+		mt[i].cpu = i % ncpu;
+		mt[i].v = sv;
+		if (!shared) {
+			mt[i].v = bi->alloc(ts->bmapsz);
+			if (!setting)
+				populate(bi, ts, mt[i].v);
+		}
+		mt[i].lat = malloc(maxlat * sizeof(*mt[i].lat));
+		mt[i].nlat = 0;
+		if (pthread_create(&mt[i].thr, NULL, mt_thread, &mt[i]))
+			errx(1, "pthread_create");
+	}
+	while (__atomic_load_n(&m.ready, __ATOMIC_ACQUIRE) < nthreads)
+		sched_yield();
+	start = mt_now();
+	__atomic_store_n(&m.go, true, __ATOMIC_RELEASE);
+	for (i = 0; i < nthreads; i++)
+		pthread_join(mt[i].thr, NULL);
+
+	printf("mt-%s-%s-%s-%s-%d: %.2f Mops/s\n", test_name, ts->set_name, setting ? "populate" : "check",
+	    shared ? "shared" : "private", nthreads, (double)nthreads * MT_PASSES * ts->nelems / (mt_now() - start) * 1000.0);
+	for (i = 0; i < nthreads; i++) {
+		double *l = mt[i].lat;
+		size_t n = mt[i].nlat;
+
+		qsort(l, n, sizeof(*l), dblcmp);
+		printf("  thread %d: %.2f Mops/s, p50 %.1f ns, p90 %.1f ns, p99 %.1f ns\n", i,
+		    (double)MT_PASSES * ts->nelems / mt[i].ns * 1000.0, l[n / 2], l[n * 9 / 10], l[n * 99 / 100]);
+		free(l);
+		if (!shared)
+			bi->free(mt[i].v);
+	}
+	if (shared)
+		bi->free(sv);
+}
+
+static void
+test_mts(int maxthreads)
+{
+	int t, s, n;
+
+	for (t = 0; t < howmany(mt_impls); t++) {
+		struct bmap_interface *bi = impl_by_name(mt_impls[t]);
+
+		for (s = 0; s < howmany(mt_sets); s++) {
+			struct test_set *ts = NULL;
+			int i;
+
+			for (i = 0; i < howmany(test_sets); i++)
+				if (!strcmp(test_sets[i].set_name, mt_sets[s]))
+					ts = &test_sets[i];
+			for (n = 1; n <= maxthreads; n = n * 2 > maxthreads && n < maxthreads ? maxthreads : n * 2) {
+				test_mt(bi, mt_impls[t], ts, true, false, n);
+				test_mt(bi, mt_impls[t], ts, false, false, n);
+				test_mt(bi, mt_impls[t], ts, false, true, n);
+			}
+		}
+	}
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: bmap [-c impl [-r ref | -b baseline] [-w baseline] [-t threshold]] [-m [-n threads]] [statdir]\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *statdir = NULL;
+	const char *cmp_impl = NULL, *cmp_ref = NULL, *cmp_base = NULL, *cmp_write = NULL;
+	double cmp_threshold = 5.0;
+	bool mt_mode = false;
+	unsigned int *conc_ids;
+	void *conc_ref;
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	long mt_threads = 0;
+	int t, ch;
+
+	while ((ch = getopt(argc, argv, "b:c:mn:r:t:w:")) != -1) {
+		switch (ch) {
+		case 'b':
+			cmp_base = optarg;
+			break;
+		case 'c':
+			cmp_impl = optarg;
+			break;
+		case 'm':
+			mt_mode = true;
+			break;
+		case 'n':
+			if ((mt_threads = strtol(optarg, NULL, 10)) < 1)
+				usage();
+			break;
+		case 'r':
+			cmp_ref = optarg;
+			break;
+		case 't':
+			cmp_threshold = strtod(optarg, NULL);
+			break;
+		case 'w':
+			cmp_write = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (cmp_impl == NULL && (cmp_ref || cmp_base || cmp_write))
+		usage();
+	if (cmp_ref && cmp_base)
+		usage();
+	if (mt_threads && !mt_mode)
+		usage();
+
+	srandom(4711);
+
+	for (t = 0; t < howmany(test_sets); t++) {
+		generate_set(&test_sets[t]);
+	}
+	for (t = 0; t < howmany(test_sets); t++) {
+		generate_probes(&test_sets[t]);
+	}
+	for (t = 0; t < howmany(test_sets); t++) {
+		generate_slices(&test_sets[t]);
+	}
+	for (t = 0; t < howmany(range_sets); t++) {
+		generate_ranges(&range_sets[t]);
+	}
+	for (t = 0; t < howmany(batch_sets); t++) {
+		generate_unsorted(&batch_sets[t]);
+	}
+
+	printf("using %s kernels\n", bmap_isa());
+
+	if (cmp_impl)
+		return compare(cmp_impl, cmp_ref, cmp_base, cmp_write, cmp_threshold);
+	if (mt_mode) {
+		test_mts(mt_threads ? mt_threads : ncpu);
+		return 0;
+	}
+
+	/* If called with an argument we'll try to generate a set of stats data we can use with ministat. */
+	if (argc > 0) {
+		statdir = argv[0];
+	}
+
+	for (t = 0; t < howmany(tests); t++) {
+		smoke_test(tests[t].bi, tests[t].n);
+		if (tests[t].bi->set_range)
+			range_smoke_test(tests[t].bi, tests[t].n);
+		if (tests[t].bi->count_range)
+			count_smoke_test(tests[t].bi, tests[t].n);
+		if (tests[t].bi->clone)
+			clone_smoke_test(tests[t].bi, tests[t].n);
+		if (tests[t].bi->freeze)
+			freeze_smoke_test(tests[t].bi, tests[t].n);
+		if (tests[t].bi->set_batch)
+			batch_smoke_test(tests[t].bi, tests[t].n);
+		if (tests[t].bi->next_run)
+			run_smoke_test(tests[t].bi, tests[t].n);
+	}
+	grow_smoke_test();
+
+	for (t = 0; t < howmany(tests); t++) {
+		int s;
+
+		for (s = 0; s < howmany(test_sets); s++)
+			test_one(tests[t].bi, tests[t].n, &test_sets[s], statdir);
+	}
+
+	mem_table();
+
+	for (t = 0; t < howmany(tests); t++) {
+		int s;
+
+		if (tests[t].bi->set_range == NULL)
+			continue;
+		for (s = 0; s < howmany(range_sets); s++)
+			test_range(tests[t].bi, tests[t].n, &range_sets[s], statdir);
+	}
+
+	for (t = 0; t < howmany(tests); t++) {
+		int s;
+
+		if (tests[t].bi->freeze == NULL)
+			continue;
+		for (s = 0; s < howmany(test_sets); s++)
+			test_frozen(tests[t].bi, tests[t].n, &test_sets[s], statdir);
+	}
+
+	for (t = 0; t < howmany(tests); t++) {
+		int s;
+
+		if (tests[t].bi->next_run == NULL)
+			continue;
+		for (s = 0; s < howmany(test_sets); s++)
+			test_runs(tests[t].bi, tests[t].n, &test_sets[s], statdir);
+	}
+
+	for (t = 0; t < howmany(test_sets); t++)
+		test_inline(&test_sets[t], statdir);
+
+	for (t = 0; t < howmany(test_sets); t++)
+		test_auto(&test_sets[t]);
+
+	for (t = 0; t < howmany(test_sets); t++)
+		test_grow(&test_sets[t], statdir);
+
+	for (t = 0; t < howmany(tests); t++) {
+		int s;
+
+		if (tests[t].bi->set_batch == NULL)
+			continue;
+		for (s = 0; s < howmany(batch_sets); s++)
+			test_batch(tests[t].bi, tests[t].n, &batch_sets[s], statdir);
+	}
+
+	for (t = 0; t < howmany(tests); t++) {
+		if (tests[t].bi->union_many)
+			test_unions(tests[t].bi, tests[t].n);
+	}
+
+	conc_ids = malloc(sizeof(*conc_ids) * CONC_NIDS);
+	conc_ref = bmap_dumb.alloc(CONC_BMAPSZ);
+	for (t = 0; t < CONC_NIDS; t++) {
+		conc_ids[t] = random() % CONC_BMAPSZ;
+		bmap_dumb.set(conc_ref, conc_ids[t]);
+	}
+	for (t = 0; t < howmany(conc_tests); t++) {
+		int n;
+
+		for (n = 1; n == 1 || n <= ncpu; n *= 2)
+			test_concurrent(conc_tests[t].bi, conc_tests[t].n, conc_tests[t].lock, n, conc_ids, conc_ref);
 	}
+	bmap_dumb.free(conc_ref);
+	free(conc_ids);
 
 	return 0;
 }